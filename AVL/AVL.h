@@ -16,9 +16,17 @@
 
 
 #include <assert.h>
+#include <limits.h>
+#include <new>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/errno.h>
 
+enum AVLCompactLayout {
+    kAVLCompactInOrder,
+    kAVLCompactVanEmdeBoas
+};
+
 enum AVLTraverseMethod {
     kAVLTraverseBreadthFirst,
     kAVLTraverseInfix,
@@ -28,44 +36,285 @@ enum AVLTraverseMethod {
 
 #ifndef kAVLMaxHeight
     // This AVL implementation may contain no more than 2^kAVLMaxHeight - 1 nodes.
-    // No checking is performed so redefine kAVLMaxHeight if required.
+    // No checking is performed so redefine kAVLMaxHeight if required. An AVLBalanceWeak
+    // tree that has seen m inserts and holds n nodes is no taller than the smaller of
+    // 1.44 log2 m and 2 log2 n, so a weak tree sizes its paths for twice the height.
     #define kAVLMaxHeight           32
 #endif
 
+#ifndef kAVLVerifyRatio
+    // With ENABLE_AVL_UNIT_TESTS every operation checks the nodes on its path, which is
+    // O(log n), and the whole tree is verified once the operations since the last full
+    // check reach size / kAVLVerifyRatio, adding O(kAVLVerifyRatio) amortized per operation.
+    #define kAVLVerifyRatio         4
+#endif
+
+
+// Balancing policies for the B parameter of AVL.
+//
+// AVLBalanceStrict keeps the subtree heights of every node within one of each other.
+//
+// AVLBalanceWeak follows the weak AVL (WAVL) rules of Haeupler, Sen and Tarjan: _height
+// is a rank rather than a height and every child is 1 or 2 ranks below its parent, with
+// leaves at rank 1. Inserts rebalance exactly as they do under the strict rules, so a tree
+// that never sees a remove is an AVL tree, but a remove ends after at most two rotations
+// and O(1) amortized rank changes where the strict rules may rotate at every level. That
+// suits write-heavy loads at the cost of a taller tree after many removes.
+struct AVLBalanceStrict { enum { weak = 0 }; };
+struct AVLBalanceWeak { enum { weak = 1 }; };
+
+// Multiplicity policies for the M parameter of AVL.
+//
+// AVLDistinct ignores the insert of a key that is already present.
+//
+// AVLMultiple makes a multiset or multimap. Each node counts the occurrences of its key, so
+// inserting a duplicate increments the count in place without allocating, count() reads it
+// and remove_one(), pop_min() and pop_max() decrement it, removing the key with its last
+// occurrence, so a multiset serves as a priority queue. A key keeps the value it was first
+// inserted with. size() and traversals see each key once, and remove, remove_range,
+// remove_if and extract take a key with all of its occurrences.
+struct AVLDistinct { enum { multiple = 0 }; };
+struct AVLMultiple { enum { multiple = 1 }; };
+
+// AVLValue is the value slot of a node. a set, where V is void, has none, so its nodes
+// are a pointer smaller and the value moves made by rotations compile away
+template<typename V> struct AVLValue {
+    V *value() const { return _value; }
+    void setValue( V *value ) { _value = value; }
+#if ENABLE_AVL_UNIT_TESTS
+    static V *test( V *value, long * ) { return value; }
+#endif
+    
+    V *                             _value;
+};
+
+template<> struct AVLValue<void> {
+    void *value() const { return NULL; }
+    void setValue( void * ) {}
+#if ENABLE_AVL_UNIT_TESTS
+    static void *test( void *, long *height ) { return height; }
+#endif
+};
+
+// AVLOccurrences counts the occurrences of a node's key in a multiset and is empty otherwise
+template<bool multiple> struct AVLOccurrences {
+    long occurrences() const { return 1; }
+    void setOccurrences( long ) {}
+};
+
+template<> struct AVLOccurrences<true> {
+    AVLOccurrences() { _occurrences = 1; }
+    
+    long occurrences() const { return _occurrences; }
+    void setOccurrences( long occurrences ) { _occurrences = occurrences; }
+    
+    long                            _occurrences;
+};
+
+// AVLReclaimer frees the trees detached by clear_async for every AVL on a single thread,
+// started by the first clear_async and kept waiting for work from then on. its state is
+// constant initialized so it's safe to use from static constructors and destructors
+struct AVLReclaimer {
+    struct AVLWork {
+        AVLWork *                   _next;
+        void                        (*_reclaim)( AVLWork *work );   // frees the work along with its tree
+    };
+    
+    // push queues work and returns true, or returns false leaving the work with the caller if the thread can't be started
+    static bool push( AVLWork *work );
+    static void *run( void *context );
+    static AVLReclaimer *shared() { static AVLReclaimer reclaimer = { PTHREAD_COND_INITIALIZER, NULL, PTHREAD_MUTEX_INITIALIZER, false, NULL }; return &reclaimer; }
+    
+    pthread_cond_t                  _available;
+    AVLWork *                       _head;
+    pthread_mutex_t                 _lock;
+    bool                            _started;
+    AVLWork *                       _tail;
+};
+
+inline bool AVLReclaimer::push( AVLWork *work ) {
+    AVLReclaimer *                  reclaimer = shared();
+    pthread_attr_t                  attributes;
+    pthread_t                       thread;
+    
+    pthread_mutex_lock( &reclaimer->_lock );
+    
+    if ( ! reclaimer->_started && ! pthread_attr_init( &attributes ) ) {
+        pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+        reclaimer->_started = ! pthread_create( &thread, &attributes, run, reclaimer );
+        pthread_attr_destroy( &attributes );
+    }
+    
+    if ( reclaimer->_started ) {
+        work->_next = NULL;
+        
+        if ( reclaimer->_tail ) reclaimer->_tail->_next = work;
+        else reclaimer->_head = work;
+        
+        reclaimer->_tail = work;
+        pthread_cond_signal( &reclaimer->_available );
+    }
+    
+    pthread_mutex_unlock( &reclaimer->_lock );
+    
+    return reclaimer->_started;
+}
+
+inline void *AVLReclaimer::run( void *context ) {
+    AVLReclaimer *                  reclaimer = (AVLReclaimer *) context;
+    AVLWork *                       work;
+    
+    for ( ;; ) {
+        pthread_mutex_lock( &reclaimer->_lock );
+        
+        while ( ! ( work = reclaimer->_head ) ) pthread_cond_wait( &reclaimer->_available, &reclaimer->_lock );
+        
+        if ( ! ( reclaimer->_head = work->_next ) ) reclaimer->_tail = NULL;
+        
+        pthread_mutex_unlock( &reclaimer->_lock );
+        
+        work->_reclaim( work );
+    }
+    
+    return NULL;
+}
+
+// AVLAllocator supplies the nodes of a tree from memory of its choosing, such as memory bound
+// to a NUMA node. every node of a tree given an allocator comes from it, except those a
+// compaction moves into a slab. it's only called by whoever is modifying the tree, so
+// clear_async leaves such a tree for clear_step or the destructor instead of another thread
+struct AVLAllocator {
+    virtual ~AVLAllocator() {}
+    
+    virtual void *allocate( size_t size ) = 0;
+    virtual void deallocate( void *memory ) = 0;
+};
+
+template<typename K, typename V> class AVLMapped;
 
-template<typename K, typename V = void> class AVL {
+template<typename K, typename V = void, typename B = AVLBalanceStrict, typename M = AVLDistinct> class AVL {
     
 protected:
     
     struct AVLNode;
     
+    // the most nodes on a path from the root, which is longer for a weak tree of the same size
+    enum { kAVLPathLength = kAVLMaxHeight * ( 1 + B::weak ) + 1 };
+    
+    template<typename, typename> friend class AVLMapped;
+    
 public:
     
     // AVLComparator return value is to zero as lhs is to rhs
     typedef long (*AVLComparator)( const K &lhs, const K &rhs );
-    // AVLTraverseCallback should return true to stop traversing
+    // AVLTraverseCallback should return true to stop traversing. a set, where V is void, passes NULL values
     typedef bool (*AVLTraverseCallback)( const K &key, V *value, void *context );
+    // AVLRemovePredicate should return true to remove the entry
+    typedef bool (*AVLRemovePredicate)( const K &key, V *value, void *context );
+    
+    // AVLHandle owns a node that isn't in any tree. extract fills it and a successful
+    // insert empties it, so entries can move between trees or be rekeyed without
+    // allocating. a handle that still holds a node when destroyed deletes it
+    class AVLHandle {
+    public:
+        AVLHandle() { _node = NULL; }
+        ~AVLHandle() { delete _node; }
+        
+        bool empty() const { return ! _node; }
+        const K &key() const { return _node->_key; }
+        V *value() const { return _node->value(); }
+        void setKey( const K &key ) { _node->_key = key; }
+        void setValue( V *value ) { _node->setValue( value ); }
+        
+    protected:
+        AVLHandle( const AVLHandle & );
+        AVLHandle &operator=( const AVLHandle & );
+        
+        AVLNode *                   _node;
+        
+        friend class AVL;
+    };
     
-    AVL( AVLComparator comparator ) { _comparator = comparator; _root = NULL; }
+    AVL( AVLComparator comparator, AVLAllocator *allocator = NULL ) {
+        _allocator = allocator; _comparator = comparator; _root = _min = _max = NULL; _count = 0; _rotations = 0; _slabs = _reclaimSlabs = _compactSlab = NULL;
+#if ENABLE_AVL_UNIT_TESTS
+        _verifyOperations = 0;
+#endif
+    }
     virtual ~AVL() { clear(); }
     
-    void clear() { clear( _root ); _root = NULL; }
-    bool find( const K &key, V **value = NULL ) const;
-    void insert( const K &key, V *value = NULL );
-    void remove( const K &key );
+    void clear() { AVLNode *node; compactEnd(); clear( _root, &_slabs, _allocator ); _root = _min = _max = NULL; _count = 0; while ( ( node = _reclaim.pop() ) ) clear( node, &_reclaimSlabs, _allocator ); }
+    // clear_async detaches the tree in O(1) and frees its nodes on a background thread, which
+    // is started by the first call and shared by every tree
+    void clear_async();
+    // clear_step detaches the tree in O(1) and frees at most budget detached nodes per
+    // call. it returns true once every node detached by earlier calls has been freed
+    bool clear_step( long budget );
+    // compact moves every node into one contiguous block, laid out in key order for scans or
+    // in van Emde Boas order for lookups, without changing the tree. compact_step moves at
+    // most budget nodes per call in key order, picking up after the last key it moved, and
+    // returns true once a pass is complete. nodes inserted behind a pass stay where they are
+    void compact( AVLCompactLayout layout = kAVLCompactInOrder );
+    bool compact_step( long budget );
+    // count returns the occurrences of key, which are at most 1 unless M is AVLMultiple
+    long count( const K &key ) const { AVLNode *node = lookup( key ); return node ? node->occurrences() : 0; }
+    bool extract( const K &key, AVLHandle &handle );
+    bool find( const K &key, V **value = NULL ) const { AVLNode *node = lookup( key ); if ( node && value ) *value = node->value(); return node; }
+    void insert( const K &key, V *value = NULL ) { insert( key, value, NULL ); }
+    // insert returns false and leaves the node in the handle if the key is already present,
+    // unless M is AVLMultiple, when the handle's occurrences are added to the key's
+    bool insert( AVLHandle &handle ) { if ( ! handle._node || ! insert( handle._node->_key, handle._node->value(), handle._node ) ) return false; handle._node = NULL; return true; }
+    // the first and last entries are cached so min and max are O(1) and pop_min and
+    // pop_max remove them without comparing keys, one occurrence at a time if M is
+    // AVLMultiple. all return false if the tree is empty
+    bool max( K *key = NULL, V **value = NULL ) const { return entry( _max, key, value ); }
+    bool min( K *key = NULL, V **value = NULL ) const { return entry( _min, key, value ); }
+    bool pop_max( K *key = NULL, V **value = NULL ) { return pop( true, key, value ); }
+    bool pop_min( K *key = NULL, V **value = NULL ) { return pop( false, key, value ); }
+    void remove( const K &key ) { release( unlink( key ), &_slabs, _allocator ); }
+    // remove_all removes key with all of its occurrences, remove_one only one of them
+    void remove_all( const K &key ) { remove( key ); }
+    void remove_one( const K &key ) { release( unlink( key, true ), &_slabs, _allocator ); }
+    // remove_range and remove_if operate on keys in [ lo, hi ) and return the number of entries removed
+    long remove_range( const K &lo, const K &hi );
+    long remove_if( const K &lo, const K &hi, AVLRemovePredicate predicate, void *context = NULL );
+    // rotations counts single rotations since construction, a double rotation being two
+    long rotations() const { return _rotations; }
+    // size counts keys, not occurrences
+    long size() const { return _count; }
     void traverse( AVLTraverseCallback callback, void *context = NULL, AVLTraverseMethod method = kAVLTraverseInfix ) const { traverse( _root, callback, context, method ); }
     
 protected:
     
-    struct AVLNode {
-        AVLNode( const K &key, V *value ) { _key = key; _height = 1; _left = _right = NULL; _value = value; }
-        AVLNode &operator=( const AVLNode &rhs ) { _key = rhs._key; _left = rhs._left; _right = rhs._right; _value = rhs._value; return *this; }
+    struct AVLNode : AVLValue<V>, AVLOccurrences<M::multiple> {
+        AVLNode( const K &key, V *value ) { _key = key; _height = 1; _left = _right = NULL; this->setValue( value ); }
+        // relocate and extract copy nodes whole, links and height included
+        AVLNode( const AVLNode &rhs ) { _key = rhs._key; _height = rhs._height; _left = rhs._left; _right = rhs._right; this->setValue( rhs.value() ); this->setOccurrences( rhs.occurrences() ); }
+        AVLNode &operator=( const AVLNode &rhs ) { _key = rhs._key; _left = rhs._left; _right = rhs._right; this->setValue( rhs.value() ); this->setOccurrences( rhs.occurrences() ); return *this; }
         
         K                           _key;
         long                        _height;
         AVLNode *                   _left;
         AVLNode *                   _right;
-        V *                         _value;
+    };
+    
+    // a block of nodes filled by a compaction. _used nodes have been placed, _live of those are still
+    // in a tree and the block is freed when the last of them is released. a compaction in progress
+    // holds one extra reference so its block outlives the nodes placed in it so far
+    struct AVLSlab {
+        bool holds( AVLNode *node ) const { return node >= _nodes && node < _nodes + _used; }
+        
+        AVLSlab *                   _next;
+        AVLNode *                   _nodes;
+        long                        _capacity;
+        long                        _live;
+        long                        _used;
+    };
+    
+    // a detached tree and the slabs holding its nodes, for the reclaimer thread
+    struct AVLReclaim : AVLReclaimer::AVLWork {
+        AVLNode *                   _root;
+        AVLSlab *                   _slabs;
     };
     
     struct AVLQueue {
@@ -85,23 +334,216 @@ protected:
         AVLQueueNode **             _last;
     };
     
-    void clear( AVLNode *root ) { if ( root ) { clear( root->_left ); clear( root->_right ); delete root; } }
+    static long clear( AVLNode *root, AVLSlab **slabs, AVLAllocator *allocator ) { long budget = LONG_MAX; destroy( root, &budget, slabs, allocator ); return LONG_MAX - budget; }
+    void compactBegin();
+    void compactEnd() { if ( _compactSlab ) unreference( _compactSlab, &_slabs ); _compactSlab = NULL; }
+    static AVLNode *destroy( AVLNode *root, long *budget, AVLSlab **slabs, AVLAllocator *allocator );
+    static void reclaim( AVLReclaimer::AVLWork *work ) { AVLReclaim *r = (AVLReclaim *) work; clear( r->_root, &r->_slabs, NULL ); delete r; }
     long height( AVLNode *node ) const { AVLNode *l = node->_left, *r = node->_right; long hl = l ? l->_height : 0, hr = r ? r->_height : 0; return 1 + ( hl > hr ? hl : hr ); }
+    AVLNode *build( AVLNode **list, long count );
+    long demote( AVLNode **path, long index );
+    bool entry( AVLNode *node, K *key, V **value ) const { if ( ! node ) return false; if ( key ) *key = node->_key; if ( value ) *value = node->value(); return true; }
+    void findBounds() { _min = leftmost( _root ); _max = rightmost( _root ); }
+    bool insert( const K &key, V *value, AVLNode *node );
+    AVLNode *join( AVLNode *left, AVLNode *node, AVLNode *right );
+    AVLNode *join( AVLNode *left, AVLNode *right ) { AVLNode *node; if ( ! right ) return left; node = unlinkMin( &right ); return join( left, node, right ); }
+    static AVLNode *leftmost( AVLNode *node ) { if ( node ) while ( node->_left ) node = node->_left; return node; }
+    AVLNode *lookup( const K &key ) const;
+    void place( AVLNode **link, long levels );
+    void placeBelow( AVLNode **link, long depth, long levels );
+    bool pop( bool last, K *key, V **value );
+    static long rank( AVLNode *node ) { return node ? node->_height : 0; }
+    bool rebalance( AVLNode *x );
+    static void release( AVLNode *node, AVLSlab **slabs, AVLAllocator *allocator );
+    void relocate( AVLNode **link );
+    static AVLNode *rightmost( AVLNode *node ) { if ( node ) while ( node->_right ) node = node->_right; return node; }
+    static AVLSlab *owner( AVLNode *node, AVLSlab *slabs ) { while ( slabs && ! slabs->holds( node ) ) slabs = slabs->_next; return slabs; }
+    static void splice( AVLSlab *slabs, AVLSlab **to ) { if ( slabs ) { while ( *to ) to = &(*to)->_next; *to = slabs; } }
+    void split( AVLNode *root, const K &key, AVLNode **less, AVLNode **greater );
+    // unlink of one occurrence of a key that has more only decrements its count and returns NULL
+    AVLNode *unlink( const K &key, bool one = false );
+    AVLNode *unlinkMin( AVLNode **root );
     bool traverse( AVLNode *root, AVLTraverseCallback callback, void *context, AVLTraverseMethod method ) const;
+    // occurrences travel with their key when two nodes trade entries
+    static void trade( AVLNode *x, AVLNode *y ) { long o = x->occurrences(); x->setOccurrences( y->occurrences() ); y->setOccurrences( o ); }
+    static void unreference( AVLSlab *slab, AVLSlab **slabs );
+#if ENABLE_AVL_UNIT_TESTS
+    // a set has no values so unit tests are handed the address of the height, which also identifies the node
+    static V *visit( AVLNode *node ) { return AVLValue<V>::test( node->value(), &node->_height ); }
+#else
+    static V *visit( AVLNode *node ) { return node->value(); }
+#endif
     
 #if ENABLE_AVL_UNIT_TESTS
-    void verifyAVL() const { assert( verifyAVL( _root ) ); }
-    bool verifyAVL( AVLNode *root ) const;
+    void verifyAVL( AVLNode **path = NULL, long count = 0 ) const;
+    bool verifyAVL( AVLNode *root, const K *lo, const K *hi, long *count ) const;
+    bool verifyNode( AVLNode *node ) const;
 #endif
     
+    AVLAllocator *                  _allocator;     // where nodes come from, the heap if NULL
     AVLComparator                   _comparator;
+    K                               _compactKey;    // the last key compact_step moved
+    AVLSlab *                       _compactSlab;   // the block compact_step is filling, if a pass is underway
+    long                            _count;
+    AVLNode *                       _max;
+    AVLNode *                       _min;
+    AVLQueue                        _reclaim;       // detached trees waiting for clear_step
+    AVLSlab *                       _reclaimSlabs;  // slabs holding nodes of those trees
     AVLNode *                       _root;
+    long                            _rotations;
+    AVLSlab *                       _slabs;
+#if ENABLE_AVL_UNIT_TESTS
+    mutable long                    _verifyOperations;  // since the whole tree was last verified
+#endif
     
 };
 
 #pragma mark -
 
-template<typename K, typename V> bool AVL<K,V>::find( const K &key, V **value ) const {
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::clear_async() {
+    AVLReclaim *                    context;
+    
+    compactEnd();
+    
+    if ( ! _root ) return;
+    
+    // the thread takes the slabs along with the tree since every node left in them is in the tree
+    
+    context = new AVLReclaim;
+    context->_reclaim = reclaim;
+    context->_root = _root;
+    context->_slabs = _slabs;
+    
+    // should no thread be available, or the allocator be unable to take nodes back on
+    // one, the tree is left for clear_step or the destructor
+    if ( _allocator || ! AVLReclaimer::push( context ) ) {
+        _reclaim.push( _root );
+        splice( _slabs, &_reclaimSlabs );
+        delete context;
+    }
+    
+    _root = _min = _max = NULL;
+    _slabs = NULL;
+    _count = 0;
+}
+
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::clear_step( long budget ) {
+    AVLNode *                       node;
+    
+    compactEnd();
+    
+    if ( _root ) {
+        _reclaim.push( _root );
+        splice( _slabs, &_reclaimSlabs );
+        _root = _min = _max = NULL;
+        _slabs = NULL;
+        _count = 0;
+    }
+    
+    while ( budget > 0 && ( node = _reclaim.pop() ) ) {
+        if ( ( node = destroy( node, &budget, &_reclaimSlabs, _allocator ) ) ) _reclaim.push( node );
+    }
+    
+    return _reclaim._head == NULL;
+}
+
+// a pass underway is abandoned and every node moves into a new block, those it had placed included
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::compact( AVLCompactLayout layout ) {
+    compactEnd();
+    
+    if ( layout == kAVLCompactVanEmdeBoas && _root ) {
+        compactBegin();
+        place( &_root, _root->_height );
+        compactEnd();
+        
+#if ENABLE_AVL_UNIT_TESTS
+        verifyAVL();
+#endif
+    } else {
+        compact_step( LONG_MAX );
+    }
+}
+
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::compact_step( long budget ) {
+    long                            index;
+    AVLNode **                      link;
+    AVLNode **                      stack[ kAVLPathLength ];
+    AVLSlab *                       slab;
+    
+    if ( ! _compactSlab ) {
+        if ( ! _count ) return true;
+        
+        compactBegin();
+    }
+    
+    slab = _compactSlab;
+    
+    // stack the links to the first node past _compactKey and to its ancestors with greater keys
+    
+    for ( index = 0, link = &_root; *link; ) {
+        if ( ! slab->_used || _comparator( (*link)->_key, _compactKey ) > 0 ) {
+            stack[ index++ ] = link;
+            link = &(*link)->_left;
+        } else {
+            link = &(*link)->_right;
+        }
+    }
+    
+    // rotations trade entries between nodes so a node already placed may turn up again. it stays put
+    
+    for ( ; index && budget > 0 && slab->_used < slab->_capacity; --budget ) {
+        link = stack[ --index ];
+        
+        if ( ! slab->holds( *link ) ) relocate( link );
+        
+        _compactKey = (*link)->_key;
+        
+        for ( link = &(*link)->_right; *link; link = &(*link)->_left ) stack[ index++ ] = link;
+    }
+    
+    if ( index && slab->_used < slab->_capacity ) return false;
+    
+    compactEnd();
+    
+#if ENABLE_AVL_UNIT_TESTS
+    verifyAVL();
+#endif
+    
+    return true;
+}
+
+// start a pass with a block sized for the tree as it is now. the pass ends early if inserts fill it
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::compactBegin() {
+    AVLSlab *                       slab;
+    
+    slab = _compactSlab = new AVLSlab;
+    slab->_nodes = (AVLNode *) ::operator new( _count * sizeof( AVLNode ) );
+    slab->_capacity = _count;
+    slab->_live = 1;
+    slab->_used = 0;
+    slab->_next = _slabs;
+    _slabs = slab;
+}
+
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::extract( const K &key, AVLHandle &handle ) {
+    AVLNode *                       node, *copy;
+    
+    if ( ! ( node = unlink( key ) ) ) return false;
+    
+    // a handle deletes its node so one in a slab or from the allocator is copied to the heap
+    if ( _allocator || owner( node, _slabs ) ) {
+        copy = new AVLNode( *node );
+        release( node, &_slabs, _allocator );
+        node = copy;
+    }
+    
+    delete handle._node;
+    handle._node = node;
+    
+    return true;
+}
+
+template<typename K, typename V, typename B, typename M> typename AVL<K,V,B,M>::AVLNode *AVL<K,V,B,M>::lookup( const K &key ) const {
     long                            c;
     AVLNode *                       root;
     
@@ -110,38 +552,74 @@ template<typename K, typename V> bool AVL<K,V>::find( const K &key, V **value )
         
         if ( c < 0 ) root = root->_left;
         else if ( c > 0 ) root = root->_right;
-        else {
-            if ( value ) *value = root->_value;
-            return true;
-        }
+        else break;
     }
     
-    return false;
+    return root;
 }
 
-template<typename K, typename V> void AVL<K,V>::insert( const K &key, V *value ) {
-    long                            c, index, height;
+// link node, or a new node if node is NULL, into the tree. returns false without
+// allocating if key is already present, unless M is AVLMultiple
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::insert( const K &key, V *value, AVLNode *node ) {
+    long                            c, height, index, maxSpine, minSpine;
     K                               k;
-    AVLNode *                       left, *node, *right, *x, *y, *z;
-    AVLNode *                       path[ kAVLMaxHeight + 1 ];
+    AVLNode *                       left, *right, *x, *y, *z;
+    AVLNode *                       path[ kAVLPathLength ];
     AVLNode **                      root;
     V *                             v;
     
-    for ( index = 0, root = &_root; ( node = *root ); ++index ) {
-        path[ index ] = node;
+    // path[ i ] is on the left spine of the tree for i <= minSpine and on the right for i <= maxSpine
+    
+    for ( index = maxSpine = minSpine = 0, root = &_root; ( x = *root ); ++index ) {
+        path[ index ] = x;
         
-        c = _comparator( key, node->_key );
+        c = _comparator( key, x->_key );
+        
+        if ( c < 0 ) { root = &x->_left; if ( minSpine == index ) ++minSpine; }
+        else if ( c > 0 ) { root = &x->_right; if ( maxSpine == index ) ++maxSpine; }
+        else if ( ! M::multiple ) return false;     // ignore duplicates
+        else {
+            // count another occurrence, or all of a handle's, which leaves its node unused
+            x->setOccurrences( x->occurrences() + ( node ? node->occurrences() : 1 ) );
+            delete node;
+            
+            return true;
+        }
+    }
+    
+    if ( node ) {
+        node->_height = 1;
+        node->_left = node->_right = NULL;
         
-        if ( c < 0 ) root = &node->_left;
-        else if ( c > 0 ) root = &node->_right;
-        else return;                // ignore duplicates
+        // a handle's node is on the heap, which a tree with an allocator doesn't use
+        if ( _allocator ) {
+            x = node;
+            node = new ( _allocator->allocate( sizeof( AVLNode ) ) ) AVLNode( *x );
+            delete x;
+        }
+    } else if ( _allocator ) {
+        node = new ( _allocator->allocate( sizeof( AVLNode ) ) ) AVLNode( key, value );
+    } else {
+        node = new AVLNode( key, value );
     }
     
-    path[ index ] = *root = new AVLNode( key, value );
+    path[ index ] = *root = node;
+    ++_count;
+    
+    if ( index == minSpine ) _min = node;
+    if ( index == maxSpine ) _max = node;
+    
+#if ENABLE_AVL_UNIT_TESTS
+    long depth = index + 1;
+#endif
     
     for ( height = 2; index; ++height ) {
         x = path[ --index ];
         
+        // the subtree we inserted into now has height - 1, if x was already at least
+        // height tall neither x nor anything above it changes
+        if ( x->_height >= height ) break;
+        
         // if the height of x is <= 2 the tree at x is balanced
         if ( ( x->_height = height ) <= 2 ) continue;
         
@@ -149,50 +627,53 @@ template<typename K, typename V> void AVL<K,V>::insert( const K &key, V *value )
         // difference in height between the children is > 1 the tree at x is unbalanced
         if ( ( left = x->_left ) && ( right = x->_right ) && ( c = left->_height - right->_height ) >= -1 && c <= 1 ) continue;
 
-        y = path[ ++index ];
-        z = path[ ++index ];
+        y = path[ index + 1 ];
+        z = path[ index + 2 ];
         
         --x->_height;
         --y->_height;
         
+        _rotations += ( y == x->_left ) == ( z == y->_left ) ? 1 : 2;
+        
         k = x->_key;
-        v = x->_value;
+        v = x->value();
+        trade( x, ( y == x->_left ) == ( z == y->_left ) ? y : z );
         
         if ( y == x->_left ) {
             if ( z == y->_left ) {
                 x->_key = y->_key;              /*         x                y        */
-                x->_value = y->_value;          /*        / \             /   \      */
+                x->setValue( y->value() );      /*        / \             /   \      */
                 y->_key = k;                    /*       y   3           z     x     */
-                y->_value = v;                  /*      / \      =>           / \    */
+                y->setValue( v );               /*      / \      =>           / \    */
                 x->_left = z;                   /*     z   2                 2   3   */
                 y->_left = y->_right;
                 y->_right = x->_right;
                 x->_right = y;
             } else {
                 x->_key = z->_key;              /*       x                  z        */
-                x->_value = z->_value;          /*      / \               /   \      */
+                x->setValue( z->value() );      /*      / \               /   \      */
                 z->_key = k;                    /*     y   3             y     x     */
-                z->_value = v;                  /*    / \        =>     /       \    */
-                y->_right = NULL;               /*   0   z             0         3   */     // y->_right = z->_left
-//              z->_left = z->_right;                                                       // z->_left|right are NULL
-                z->_right = x->_right;
+                z->setValue( v );               /*    / \        =>     / \   / \    */
+                y->_right = z->_left;           /*   0   z             0   1 2   3   */
+                z->_left = z->_right;           /*      / \                          */
+                z->_right = x->_right;          /*     1   2                         */
                 x->_right = z;
             }
         } else {
             if ( z == y->_left ) {
                 x->_key = z->_key;              /*     x                    z        */
-                x->_value = z->_value;          /*    / \                 /   \      */
+                x->setValue( z->value() );      /*    / \                 /   \      */
                 z->_key = k;                    /*   0   y               x     y     */
-                z->_value = v;                  /*      / \      =>     /       \    */
-                y->_left = NULL;                /*     z   3           0         3   */     // y->_left = z->_right
-//              z->_right = z->_left;                                                       // z->_left|right are NULL
-                z->_left = x->_left;
+                z->setValue( v );               /*      / \      =>     / \   / \    */
+                y->_left = z->_right;           /*     z   3           0   1 2   3   */
+                z->_right = z->_left;           /*    / \                            */
+                z->_left = x->_left;            /*   1   2                           */
                 x->_left = z;
             } else {
                 x->_key = y->_key;              /*     x                    y        */
-                x->_value = y->_value;          /*    / \                 /   \      */
+                x->setValue( y->value() );      /*    / \                 /   \      */
                 y->_key = k;                    /*   0   y               x     z     */
-                y->_value = v;                  /*      / \      =>     / \          */
+                y->setValue( v );               /*      / \      =>     / \          */
                 x->_right = z;                  /*     1   z           0   1         */
                 y->_right = y->_left;
                 y->_left = x->_left;
@@ -200,208 +681,681 @@ template<typename K, typename V> void AVL<K,V>::insert( const K &key, V *value )
             }
         }
         
+        // the rotation moves entries between nodes so a bound in x's subtree may now be in another node
+        if ( index <= minSpine ) _min = leftmost( x );
+        if ( index <= maxSpine ) _max = rightmost( x );
+        
         break;
     }
     
 #if ENABLE_AVL_UNIT_TESTS
-    verifyAVL();
+    verifyAVL( path, depth );
 #endif
+    
+    return true;
+}
+
+// free at most *budget nodes of the tree at root, deducting the nodes freed from *budget,
+// and return what is left of the tree. rotating right until a node has no left child lets
+// it be freed before its right subtree so no stack is needed and nothing is allocated
+template<typename K, typename V, typename B, typename M> typename AVL<K,V,B,M>::AVLNode *AVL<K,V,B,M>::destroy( AVLNode *root, long *budget, AVLSlab **slabs, AVLAllocator *allocator ) {
+    AVLNode *                       left, *right;
+    
+    while ( root && *budget > 0 ) {
+        if ( ( left = root->_left ) ) {
+            root->_left = left->_right;
+            left->_right = root;
+            root = left;
+        } else {
+            right = root->_right;
+            release( root, slabs, allocator );
+            root = right;
+            --*budget;
+        }
+    }
+    
+    return root;
 }
 
-template<typename K, typename V> void AVL<K,V>::remove( const K &key ) {
-    long                            c, heightLeft, heightRight, index;
+// detach the node holding key from the tree and return it, or NULL if key isn't present
+template<typename K, typename V, typename B, typename M> typename AVL<K,V,B,M>::AVLNode *AVL<K,V,B,M>::unlink( const K &key, bool one ) {
+    long                            c, index, maxFrom, maxSpine, minFrom, minSpine;
     K                               k;
-    AVLNode *                       left, *node, *right, *x, *y, *z;
-    AVLNode *                       path[ kAVLMaxHeight + 1 ];
+    AVLNode *                       left, *node, *right;
+    AVLNode *                       path[ kAVLPathLength ];
     AVLNode **                      root, **successor;
     V *                             v;
     
-    for ( index = 0, root = &_root; ( node = *root ); ++index ) {
+    // path[ i ] is on the left spine of the tree for i <= minSpine and on the right for i <= maxSpine
+    
+    for ( index = maxSpine = minSpine = 0, root = &_root; ( node = *root ); ++index ) {
         path[ index ] = node;
         
         c = _comparator( key, node->_key );
         
-        if ( c < 0 ) root = &node->_left;
-        else if ( c > 0 ) root = &node->_right;
+        if ( c < 0 ) { root = &node->_left; if ( minSpine == index ) ++minSpine; }
+        else if ( c > 0 ) { root = &node->_right; if ( maxSpine == index ) ++maxSpine; }
         else goto found;
     }
     
-    return;
+    return NULL;
     
 found:
     
-    // root now points to the node * to be deleted
+    if ( one && node->occurrences() > 1 ) {
+        node->setOccurrences( node->occurrences() - 1 );
+        return NULL;
+    }
+    
+    // root now points to the node * to be detached
+    
+    --_count;
     
     left = node->_left;
     right = node->_right;
     
     if ( ! left && ! right ) {
         *root = NULL;
-        
-        delete node;
     } else if ( ! left ) {
         *root = right;
-        
-        delete node;
     } else if ( ! right ) {
         *root = left;
-        
-        delete node;
     } else {
         // find node's successor: go right then all the way left
+        if ( maxSpine == index ) ++maxSpine;
+        
         path[ ++index ] = right;
         
         for ( successor = &node->_right; (*successor)->_left; successor = &(*successor)->_left ) {
             path[ ++index ] = (*successor)->_left;
         }
         
+        // trade entries with the successor so node keeps its place in the tree
+        // and the successor, which is simple to detach, leaves with key and value
+        
+        k = node->_key;
+        v = node->value();
+        trade( node, *successor );
         node->_key = (*successor)->_key;
+        node->setValue( (*successor)->value() );
         node = *successor;
+        node->_key = k;
+        node->setValue( v );
         
-        *successor = (*successor)->_right;
+        *successor = node->_right;
+    }
+    
+    node->_height = 1;
+    node->_left = node->_right = NULL;
+    
+    // recompute height and rebalance if necessary. path[ index ] was detached so if it was
+    // on a spine the bound is found below its parent, unless a rotation higher up moved it
+    
+    minFrom = index <= minSpine ? index - 1 : LONG_MAX;
+    maxFrom = index <= maxSpine ? index - 1 : LONG_MAX;
+    
+#if ENABLE_AVL_UNIT_TESTS
+    long depth = index;
+#endif
+    
+    if ( B::weak ) {
+        if ( ( index = demote( path, index ) ) != LONG_MAX ) {
+            if ( index <= minSpine ) minFrom = index;
+            if ( index <= maxSpine ) maxFrom = index;
+        }
+    } else {
+        while ( index ) {
+            if ( rebalance( path[ --index ] ) ) {
+                if ( index <= minSpine ) minFrom = index;
+                if ( index <= maxSpine ) maxFrom = index;
+            }
+        }
+    }
+    
+    if ( minFrom != LONG_MAX ) _min = leftmost( minFrom < 0 ? _root : path[ minFrom ] );
+    if ( maxFrom != LONG_MAX ) _max = rightmost( maxFrom < 0 ? _root : path[ maxFrom ] );
+    
+#if ENABLE_AVL_UNIT_TESTS
+    verifyAVL( path, depth );
+#endif
+    
+    return node;
+}
+
+template<typename K, typename V, typename B, typename M> long AVL<K,V,B,M>::remove_range( const K &lo, const K &hi ) {
+    long                            count;
+    AVLNode *                       greater, *less, *middle;
+    
+    if ( _comparator( lo, hi ) >= 0 ) return 0;
+    
+    // cut out the interval with two splits so only the boundary paths are rebalanced
+    
+    split( _root, lo, &less, &greater );
+    split( greater, hi, &middle, &greater );
+    
+    count = clear( middle, &_slabs, _allocator );
+    
+    _root = join( less, greater );
+    _count -= count;
+    
+    findBounds();
+    
+#if ENABLE_AVL_UNIT_TESTS
+    verifyAVL();
+#endif
+    
+    return count;
+}
+
+template<typename K, typename V, typename B, typename M> long AVL<K,V,B,M>::remove_if( const K &lo, const K &hi, AVLRemovePredicate predicate, void *context ) {
+    long                            count, kept;
+    AVLNode *                       greater, *left, *less, *list, *next, *node;
+    AVLNode **                      tail;
+    
+    if ( _comparator( lo, hi ) >= 0 ) return 0;
+    
+    split( _root, lo, &less, &greater );
+    split( greater, hi, &node, &greater );
+    
+    // rotate right until the node has no left child to visit the interval in order
+    // without a stack, keeping survivors in a list linked through _right
+    
+    for ( count = kept = 0, list = NULL, tail = &list; node; node = next ) {
+        if ( ( left = node->_left ) ) {
+            node->_left = left->_right;
+            left->_right = node;
+            next = left;
+        } else if ( next = node->_right, predicate( node->_key, node->value(), context ) ) {
+            release( node, &_slabs, _allocator );
+            ++count;
+        } else {
+            *tail = node;
+            tail = &node->_right;
+            ++kept;
+        }
+    }
+    
+    _root = join( less, join( build( &list, kept ), greater ) );
+    _count -= count;
+    
+    findBounds();
+    
+#if ENABLE_AVL_UNIT_TESTS
+    verifyAVL();
+#endif
+    
+    return count;
+}
+
+// build a balanced tree from the first count nodes of a list linked through _right
+template<typename K, typename V, typename B, typename M> typename AVL<K,V,B,M>::AVLNode *AVL<K,V,B,M>::build( AVLNode **list, long count ) {
+    AVLNode *                       left, *node;
+    
+    if ( ! count ) return NULL;
+    
+    left = build( list, count / 2 );
+    
+    node = *list;
+    *list = node->_right;
+    
+    node->_left = left;
+    node->_right = build( list, count - count / 2 - 1 );
+    node->_height = height( node );
+    
+    return node;
+}
+
+// join two trees and a node whose key lies between them. the shorter tree is
+// hung off the spine of the taller one where the heights match, so only that
+// spine is rebalanced
+template<typename K, typename V, typename B, typename M> typename AVL<K,V,B,M>::AVLNode *AVL<K,V,B,M>::join( AVLNode *left, AVLNode *node, AVLNode *right ) {
+    long                            heightLeft, heightRight, index;
+    AVLNode *                       path[ kAVLPathLength ];
+    AVLNode *                       root;
+    AVLNode **                      link;
+    
+    heightLeft = left ? left->_height : 0;
+    heightRight = right ? right->_height : 0;
+    
+    if ( heightLeft > heightRight + 1 ) {
+        for ( index = 0, link = &left; *link && (*link)->_height > heightRight + 1; link = &(*link)->_right ) path[ index++ ] = *link;
         
-        delete node;
+        root = left;
+        node->_left = *link;
+        node->_right = right;
+    } else if ( heightRight > heightLeft + 1 ) {
+        for ( index = 0, link = &right; *link && (*link)->_height > heightLeft + 1; link = &(*link)->_left ) path[ index++ ] = *link;
+        
+        root = right;
+        node->_left = left;
+        node->_right = *link;
+    } else {
+        node->_left = left;
+        node->_right = right;
+        node->_height = height( node );
+        
+        return node;
+    }
+    
+    *link = node;
+    node->_height = height( node );
+    
+    while ( index ) rebalance( path[ --index ] );
+    
+    return root;
+}
+
+// move the nodes within levels of *link into the compaction block in van Emde Boas order: the
+// top half of the levels recursively, then each subtree hanging below them the same way, so
+// a search touches O( log n / log b ) blocks of b nodes whatever b is
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::place( AVLNode **link, long levels ) {
+    long                            top;
+    
+    if ( ! *link ) return;
+    
+    if ( levels == 1 ) {
+        relocate( link );
+    } else {
+        top = ( levels + 1 ) / 2;
+        
+        place( link, top );
+        placeBelow( link, top, levels - top );
+    }
+}
+
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::placeBelow( AVLNode **link, long depth, long levels ) {
+    if ( ! *link ) return;
+    
+    if ( ! depth ) {
+        place( link, levels );
+    } else {
+        placeBelow( &(*link)->_left, depth - 1, levels );
+        placeBelow( &(*link)->_right, depth - 1, levels );
+    }
+}
+
+// detach and free the first or last node, or take one of its occurrences if it has more. every
+// node on the way there is on that spine so the new bound is at the end of it, and only a
+// rotation at the root can move the opposite bound
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::pop( bool last, K *key, V **value ) {
+    long                            from, index;
+    bool                            rotated;
+    AVLNode *                       node;
+    AVLNode *                       path[ kAVLPathLength ];
+    AVLNode **                      link;
+    
+    if ( ! _root ) return false;
+    
+    node = last ? _max : _min;
+    
+    if ( node->occurrences() > 1 ) {
+        node->setOccurrences( node->occurrences() - 1 );
+        entry( node, key, value );
+        return true;
+    }
+    
+    for ( index = 0, link = &_root; last ? (*link)->_right : (*link)->_left; link = last ? &(*link)->_right : &(*link)->_left ) {
+        path[ index++ ] = *link;
     }
     
-    // recompute height and rebalance if necessary
+    node = *link;
+    *link = last ? node->_left : node->_right;
+    --_count;
+    
+#if ENABLE_AVL_UNIT_TESTS
+    long depth = index;
+#endif
+    
+    from = index - 1;
+    rotated = false;
+    
+    if ( B::weak ) {
+        if ( ( index = demote( path, index ) ) != LONG_MAX ) {
+            from = index;
+            rotated = ! index;
+        }
+    } else {
+        while ( index ) {
+            if ( rebalance( path[ --index ] ) ) {
+                from = index;
+                rotated = ! index;
+            }
+        }
+    }
+    
+    if ( last ) {
+        _max = rightmost( from < 0 ? _root : path[ from ] );
+        if ( rotated || _min == node ) _min = leftmost( _root );
+    } else {
+        _min = leftmost( from < 0 ? _root : path[ from ] );
+        if ( rotated || _max == node ) _max = rightmost( _root );
+    }
+    
+    entry( node, key, value );
+    release( node, &_slabs, _allocator );
+    
+#if ENABLE_AVL_UNIT_TESTS
+    verifyAVL( path, depth );
+#endif
+    
+    return true;
+}
+
+// restore the weak AVL rules on path[ 0 .. index - 1 ] after a node below path[ index - 1 ]
+// was detached, returning the index of the node that rotated or LONG_MAX. ranks drop only
+// while a child is 3 ranks below its parent and at most one single or double rotation ends
+// it. as in rebalance, entries rotate rather than nodes
+template<typename K, typename V, typename B, typename M> long AVL<K,V,B,M>::demote( AVLNode **path, long index ) {
+    long                            r, rankY;
+    K                               k;
+    AVLNode *                       w, *x, *y, *z;
+    V *                             v;
     
     while ( index ) {
         x = path[ --index ];
+        r = x->_height;
         
-        left = x->_left;
-        right = x->_right;
-        
-        if ( ! left && ! right ) {
-            x->_height = 1;
+        // a leaf has rank 1
+        if ( ! x->_left && ! x->_right ) {
+            if ( r == 1 ) break;
             
+            x->_height = 1;
             continue;
-        } else if ( ! left ) {
-            if ( ( x->_height = right->_height + 1 ) <= 2 ) continue;
+        }
+        
+        // y is the sibling of a child 3 ranks below x. without one x is fine and so is the rest
+        if ( r - rank( x->_left ) == 3 ) y = x->_right;
+        else if ( r - rank( x->_right ) == 3 ) y = x->_left;
+        else break;
+        
+        rankY = y->_height;
+        
+        // if y is 2 ranks below x, or 1 below with both children 2 below it, demoting x
+        // (and y) fixes x but may leave x 3 ranks below its parent
+        if ( r - rankY == 2 ) {
+            x->_height = r - 1;
+            continue;
+        } else if ( rankY - rank( y->_left ) == 2 && rankY - rank( y->_right ) == 2 ) {
+            x->_height = r - 1;
+            y->_height = rankY - 1;
+            continue;
+        }
+        
+        // otherwise rotate. x keeps rank r so nothing above changes. z is y's outer
+        // child and w its inner one; a single rotation works unless z is 2 ranks down
+        
+        z = y == x->_left ? y->_left : y->_right;
+        w = y == x->_left ? y->_right : y->_left;
+        
+        k = x->_key;
+        v = x->value();
+        trade( x, rankY - rank( z ) == 1 ? y : w );
+        
+        if ( rankY - rank( z ) == 1 ) {
+            ++_rotations;
             
-            y = right;
-        } else if ( ! right ) {
-            if ( ( x->_height = left->_height + 1 ) <= 2 ) continue;
+            x->_key = y->_key;
+            x->setValue( y->value() );
+            y->_key = k;
+            y->setValue( v );
             
-            y = left;
+            if ( y == x->_left ) {
+                x->_left = z;               /*         x                y        */
+                y->_left = w;               /*        / \             /   \      */
+                y->_right = x->_right;      /*       y   3           z     x     */
+                x->_right = y;              /*      / \      =>           / \    */
+            } else {                        /*     z   w                 w   3   */
+                x->_right = z;
+                y->_right = w;
+                y->_left = x->_left;
+                x->_left = y;
+            }
+            
+            // y now holds x's entry one rank down, or at rank 1 if it became a leaf
+            y->_height = y->_left || y->_right ? r - 1 : 1;
         } else {
-            heightLeft = left->_height;
-            heightRight = right->_height;
+            _rotations += 2;
             
-            x->_height = 1 + ( heightLeft > heightRight ? heightLeft : heightRight );
+            x->_key = w->_key;
+            x->setValue( w->value() );
+            w->_key = k;
+            w->setValue( v );
             
-            if ( heightLeft > heightRight + 1 ) {
-                y = left;
-            } else if ( heightRight > heightLeft + 1 ) {
-                y = right;
-            } else {
-                continue;
+            if ( y == x->_left ) {
+                y->_right = w->_left;       /*       x                  w        */
+                w->_left = w->_right;       /*      / \               /   \      */
+                w->_right = x->_right;      /*     y   3             y     x     */
+                x->_right = w;              /*    / \        =>     / \   / \    */
+            } else {                        /*   z   w             z   1 2   3   */
+                y->_left = w->_right;       /*      / \                          */
+                w->_right = w->_left;       /*     1   2                         */
+                w->_left = x->_left;
+                x->_left = w;
             }
+            
+            y->_height = r - 2;
+            w->_height = r - 2;
         }
         
-        left = y->_left;
-        right = y->_right;
+        return index;
+    }
+    
+    return LONG_MAX;
+}
+
+// recompute the height of x and rotate if its subtrees differ in height by more than one,
+// returning true if it rotated. keys and values are rotated rather than nodes so x remains
+// the root of its subtree and the link to it in its parent never changes
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::rebalance( AVLNode *x ) {
+    long                            heightLeft, heightRight;
+    bool                            single;
+    K                               k;
+    AVLNode *                       left, *right, *y, *z;
+    V *                             v;
+    
+    left = x->_left;
+    right = x->_right;
+    
+    if ( ! left && ! right ) {
+        x->_height = 1;
         
-        z = left && ( ! right || left->_height > right->_height ) ? left : right;
+        return false;
+    } else if ( ! left ) {
+        if ( ( x->_height = right->_height + 1 ) <= 2 ) return false;
         
-        k = x->_key;
-        v = x->_value;
+        y = right;
+    } else if ( ! right ) {
+        if ( ( x->_height = left->_height + 1 ) <= 2 ) return false;
         
-        if ( y == x->_left ) {
-            if ( z == y->_left ) {
-                x->_key = y->_key;              /*         x                y        */
-                x->_value = y->_value;          /*        / \             /   \      */
-                y->_key = k;                    /*       y   3           z     x     */
-                y->_value = v;                  /*      / \      =>     / \   / \    */
-                x->_left = z;                   /*     z   2           0   1 2   3   */
-                y->_left = y->_right;           /*    / \                            */
-                y->_right = x->_right;          /*   0   1                           */
-                x->_right = y;
-                
-                left = z;
-                right = y;
-            } else {
-                x->_key = z->_key;              /*       x                  z        */
-                x->_value = z->_value;          /*      / \               /   \      */
-                z->_key = k;                    /*     y   3             y     x     */
-                z->_value = v;                  /*    / \        =>     / \   / \    */
-                y->_right = z->_left;           /*   0   z             0   1 2   3   */
-                z->_left = z->_right;           /*      / \                          */
-                z->_right = x->_right;          /*     1   2                         */
-                x->_right = z;
-                
-                left = y;
-                right = z;
-            }
+        y = left;
+    } else {
+        heightLeft = left->_height;
+        heightRight = right->_height;
+        
+        x->_height = 1 + ( heightLeft > heightRight ? heightLeft : heightRight );
+        
+        if ( heightLeft > heightRight + 1 ) {
+            y = left;
+        } else if ( heightRight > heightLeft + 1 ) {
+            y = right;
         } else {
-            if ( z == y->_left ) {
-                x->_key = z->_key;              /*     x                    z        */
-                x->_value = z->_value;          /*    / \                 /   \      */
-                z->_key = k;                    /*   0   y               x     y     */
-                z->_value = v;                  /*      / \      =>     / \   / \    */
-                y->_left = z->_right;           /*     z   3           0   1 2   3   */
-                z->_right = z->_left;           /*    / \                            */
-                z->_left = x->_left;            /*   1   2                           */
-                x->_left = z;
-                
-                left = z;
-                right = y;
-            } else {
-                x->_key = y->_key;              /*     x                    y        */
-                x->_value = y->_value;          /*    / \                 /   \      */
-                y->_key = k;                    /*   0   y               x     z     */
-                y->_value = v;                  /*      / \      =>     / \   / \    */
-                x->_right = z;                  /*     1   z           0   1 2   3   */
-                y->_right = y->_left;           /*        / \                        */
-                y->_left = x->_left;            /*       2   3                       */
-                x->_left = y;
-                
-                left = y;
-                right = z;
-            }
+            return false;
+        }
+    }
+    
+    left = y->_left;
+    right = y->_right;
+    heightLeft = left ? left->_height : 0;
+    heightRight = right ? right->_height : 0;
+    
+    z = heightLeft > heightRight ? left : right;
+    
+    // on a tie z is y's right child. that's a double rotation when y is a left child and it
+    // only leaves y balanced if z's left subtree is at most one shorter than y's left. under
+    // the strict rules that means z's left is at least as tall as its right, but a weak z
+    // may have two short subtrees
+    if ( heightLeft == heightRight && y == x->_left && rank( z->_left ) + 1 < heightLeft ) z = left;
+    
+    single = ( y == x->_left ) == ( z == y->_left );
+    _rotations += single ? 1 : 2;
+    
+    k = x->_key;
+    v = x->value();
+    trade( x, single ? y : z );
+    
+    if ( y == x->_left ) {
+        if ( z == y->_left ) {
+            x->_key = y->_key;              /*         x                y        */
+            x->setValue( y->value() );      /*        / \             /   \      */
+            y->_key = k;                    /*       y   3           z     x     */
+            y->setValue( v );               /*      / \      =>     / \   / \    */
+            x->_left = z;                   /*     z   2           0   1 2   3   */
+            y->_left = y->_right;           /*    / \                            */
+            y->_right = x->_right;          /*   0   1                           */
+            x->_right = y;
+        } else {
+            x->_key = z->_key;              /*       x                  z        */
+            x->setValue( z->value() );      /*      / \               /   \      */
+            z->_key = k;                    /*     y   3             y     x     */
+            z->setValue( v );               /*    / \        =>     / \   / \    */
+            y->_right = z->_left;           /*   0   z             0   1 2   3   */
+            z->_left = z->_right;           /*      / \                          */
+            z->_right = x->_right;          /*     1   2                         */
+            x->_right = z;
         }
+    } else {
+        if ( z == y->_left ) {
+            x->_key = z->_key;              /*     x                    z        */
+            x->setValue( z->value() );      /*    / \                 /   \      */
+            z->_key = k;                    /*   0   y               x     y     */
+            z->setValue( v );               /*      / \      =>     / \   / \    */
+            y->_left = z->_right;           /*     z   3           0   1 2   3   */
+            z->_right = z->_left;           /*    / \                            */
+            z->_left = x->_left;            /*   1   2                           */
+            x->_left = z;
+        } else {
+            x->_key = y->_key;              /*     x                    y        */
+            x->setValue( y->value() );      /*    / \                 /   \      */
+            y->_key = k;                    /*   0   y               x     z     */
+            y->setValue( v );               /*      / \      =>     / \   / \    */
+            x->_right = z;                  /*     1   z           0   1 2   3   */
+            y->_right = y->_left;           /*        / \                        */
+            y->_left = x->_left;            /*       2   3                       */
+            x->_left = y;
+        }
+    }
+    
+    // a double rotation gives y and z new subtrees but a single one leaves z's alone, and
+    // under the weak rules z's rank may be more than its height so it mustn't be recomputed
+    if ( ! single ) z->_height = height( z );
+    y->_height = height( y );
+    x->_height = height( x );
+    
+    return true;
+}
+
+// free a node, which is in one of slabs, from allocator if there is one, or on the heap
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::release( AVLNode *node, AVLSlab **slabs, AVLAllocator *allocator ) {
+    AVLSlab *                       in;
+    
+    if ( ! node ) return;
+    
+    if ( ( in = owner( node, *slabs ) ) ) {
+        node->~AVLNode();
+        unreference( in, slabs );
+    } else if ( allocator ) {
+        node->~AVLNode();
+        allocator->deallocate( node );
+    } else {
+        delete node;
+    }
+}
+
+// copy *link into the next node of the compaction block and release the original
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::relocate( AVLNode **link ) {
+    AVLNode *                       copy, *node;
+    
+    node = *link;
+    copy = new ( &_compactSlab->_nodes[ _compactSlab->_used++ ] ) AVLNode( *node );
+    ++_compactSlab->_live;
+    
+    *link = copy;
+    
+    if ( _min == node ) _min = copy;
+    if ( _max == node ) _max = copy;
+    
+    release( node, &_slabs, _allocator );
+}
+
+// split a tree into the nodes with keys < key and those with keys >= key. the
+// subtrees hanging off the search path are joined bottom-up and since their
+// heights increase along the way the joins cost O(log n) in total
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::split( AVLNode *root, const K &key, AVLNode **less, AVLNode **greater ) {
+    long                            index;
+    bool                            before[ kAVLPathLength ];
+    AVLNode *                       node;
+    AVLNode *                       path[ kAVLPathLength ];
+    
+    for ( index = 0; root; ++index ) {
+        path[ index ] = root;
         
-        left->_height = heightLeft = height( left );
-        right->_height = heightRight = height( right );
+        root = ( before[ index ] = _comparator( root->_key, key ) < 0 ) ? root->_right : root->_left;
+    }
+    
+    *less = *greater = NULL;
+    
+    while ( index ) {
+        node = path[ --index ];
         
-        x->_height = 1 + ( heightLeft > heightRight ? heightLeft : heightRight );
+        if ( before[ index ] ) *less = join( node->_left, node, *less );
+        else *greater = join( *greater, node, node->_right );
     }
+}
+
+// detach the leftmost node of a non-empty tree
+template<typename K, typename V, typename B, typename M> typename AVL<K,V,B,M>::AVLNode *AVL<K,V,B,M>::unlinkMin( AVLNode **root ) {
+    long                            index;
+    AVLNode *                       node;
+    AVLNode *                       path[ kAVLPathLength ];
+    AVLNode **                      link;
     
-#if ENABLE_AVL_UNIT_TESTS
-    verifyAVL();
-#endif
+    for ( index = 0, link = root; (*link)->_left; link = &(*link)->_left ) path[ index++ ] = *link;
+    
+    node = *link;
+    *link = node->_right;
+    
+    while ( index ) rebalance( path[ --index ] );
+    
+    return node;
 }
 
-template<typename K, typename V> bool AVL<K,V>::traverse( AVLNode *root, AVLTraverseCallback callback, void *context, AVLTraverseMethod method ) const {
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::traverse( AVLNode *root, AVLTraverseCallback callback, void *context, AVLTraverseMethod method ) const {
     AVLQueue                        queue;
     bool                            stop;
     
     if ( ! root ) return false;
-
-#if ENABLE_AVL_UNIT_TESTS
-    root->_value = &root->_height;
-#endif
-
+    
     switch ( method ) {
         case kAVLTraversePrefix: {
-            stop = callback( root->_key, root->_value, context );
+            stop = callback( root->_key, visit( root ), context );
             if ( ! stop ) stop = traverse( root->_left, callback, context, method );
             if ( ! stop ) stop = traverse( root->_right, callback, context, method );
         } break;
             
         case kAVLTraverseInfix: {
             stop = traverse( root->_left, callback, context, method );
-            if ( ! stop ) stop = callback( root->_key, root->_value, context );
+            if ( ! stop ) stop = callback( root->_key, visit( root ), context );
             if ( ! stop ) stop = traverse( root->_right, callback, context, method );
         } break;
             
         case kAVLTraversePostfix: {
             stop = traverse( root->_left, callback, context, method );
             if ( ! stop ) stop = traverse( root->_right, callback, context, method );
-            if ( ! stop ) stop = callback( root->_key, root->_value, context );
+            if ( ! stop ) stop = callback( root->_key, visit( root ), context );
         } break;
             
         case kAVLTraverseBreadthFirst: {
-            while ( ! ( stop = callback( root->_key, root->_value, context ) ) ) {
+            while ( ! ( stop = callback( root->_key, visit( root ), context ) ) ) {
                 if ( root->_left ) queue.push( root->_left );
                 if ( root->_right ) queue.push( root->_right );
                 if ( ! ( root = queue.pop() ) ) break;
@@ -414,26 +1368,72 @@ template<typename K, typename V> bool AVL<K,V>::traverse( AVLNode *root, AVLTrav
     return stop;
 }
 
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::unreference( AVLSlab *slab, AVLSlab **slabs ) {
+    if ( --slab->_live ) return;
+    
+    while ( *slabs != slab ) slabs = &(*slabs)->_next;
+    
+    *slabs = slab->_next;
+    ::operator delete( slab->_nodes );
+    delete slab;
+}
+
 #if ENABLE_AVL_UNIT_TESTS
 
 inline long AVLAbs( long n ) { return n < 0 ? -n : n; }
 
-template<typename K, typename V> bool AVL<K,V>::verifyAVL( AVLNode *root ) const {
-    if ( ! root ) return true;
+// check the nodes an operation touched, and their children since rotations reach
+// those, then verify the whole tree if enough operations have gone by
+template<typename K, typename V, typename B, typename M> void AVL<K,V,B,M>::verifyAVL( AVLNode **path, long count ) const {
+    long                            index, size;
+    AVLNode *                       node;
     
-    if ( ! root->_left && ! root->_right ) {
-        return root->_height == 1;
-    } else if ( ! root->_left ) {
-        return root->_right->_height == root->_height - 1 && verifyAVL( root->_right );
-    } else if ( ! root->_right ) {
-        return root->_left->_height == root->_height - 1 && verifyAVL( root->_left );
-    } else {
-        return
-            verifyAVL( root->_left ) &&
-            verifyAVL( root->_right ) &&
-            AVLAbs( root->_left->_height - root->_right->_height ) <= 1 &&
-            ( root->_left->_height == root->_height - 1 || root->_right->_height == root->_height - 1 );
+    for ( index = 0; index < count; ++index ) {
+        node = path[ index ];
+        
+        assert( verifyNode( node ) );
+        assert( ! node->_left || verifyNode( node->_left ) );
+        assert( ! node->_right || verifyNode( node->_right ) );
     }
+    
+    if ( ++_verifyOperations * kAVLVerifyRatio < _count ) return;
+    
+    _verifyOperations = 0;
+    
+    assert( verifyAVL( _root, NULL, NULL, &size ) );
+    assert( size == _count && _min == leftmost( _root ) && _max == rightmost( _root ) );
+}
+
+// verify heights, balance and that every key lies between lo and hi, which are NULL when unbounded
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::verifyAVL( AVLNode *root, const K *lo, const K *hi, long *count ) const {
+    long                            countLeft, countRight;
+    
+    *count = 0;
+    
+    if ( ! root ) return true;
+    
+    if ( ( lo && _comparator( *lo, root->_key ) >= 0 ) || ( hi && _comparator( root->_key, *hi ) >= 0 ) ) return false;
+    if ( ! verifyNode( root ) ) return false;
+    if ( ! verifyAVL( root->_left, lo, &root->_key, &countLeft ) || ! verifyAVL( root->_right, &root->_key, hi, &countRight ) ) return false;
+    
+    *count = 1 + countLeft + countRight;
+    
+    return true;
+}
+
+// verify the height and balance of node, or its rank under the weak rules, and the order of its children's keys
+template<typename K, typename V, typename B, typename M> bool AVL<K,V,B,M>::verifyNode( AVLNode *node ) const {
+    AVLNode *                       left = node->_left, *right = node->_right;
+    long                            heightLeft = left ? left->_height : 0, heightRight = right ? right->_height : 0;
+    long                            r = node->_height;
+    
+    return
+        ( B::weak ?
+            r - heightLeft >= 1 && r - heightLeft <= 2 && r - heightRight >= 1 && r - heightRight <= 2 && ( left || right || r == 1 ) :
+            r == 1 + ( heightLeft > heightRight ? heightLeft : heightRight ) && AVLAbs( heightLeft - heightRight ) <= 1 ) &&
+        node->occurrences() >= 1 &&
+        ( ! left || _comparator( left->_key, node->_key ) < 0 ) &&
+        ( ! right || _comparator( node->_key, right->_key ) < 0 );
 }
 
 #endif
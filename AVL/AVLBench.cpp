@@ -0,0 +1,409 @@
+//
+//  AVLBench.cpp
+//  AVL
+//
+//  Copyright (c) 2014 Balance Software. All rights reserved.
+//
+//  Benchmarks comparing AVL with the standard containers, its balancing
+//  policies with each other, its node layouts, the footprint of a set with
+//  that of a map and AVLReplicated with a shared tree.  This isn't part of the test target, build it on its own
+//  with optimizations on, e.g.
+//
+//      c++ -std=gnu++11 -O2 AVLBench.cpp -o AVLBench -lpthread && ./AVLBench
+//
+
+#include <chrono>
+#include <iostream>
+#include <queue>
+#include <set>
+#include <stdio.h>
+#include <vector>
+
+#if defined( __APPLE__ )
+    #include <malloc/malloc.h>
+#elif defined( __GLIBC__ )
+    #include <malloc.h>
+#endif
+
+using namespace std;
+
+#import "AVL.h"
+#import "AVLReplicated.h"
+
+long compareLongs( const long &lhs, const long &rhs ) {
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+double now() {
+    return chrono::duration<double>( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// deadlines are made unique by folding a sequence number into the low bits since AVL
+// ignores duplicate keys and every container has to see the same keys
+struct Timers {
+    Timers( long seed ) { _random = seed; _sequence = 0; }
+    
+    long next( long now ) { _random = _random * 6364136223846793005UL + 1442695040888963407UL; return ( now + (long) ( ( _random >> 33 ) & 0xffff ) ) << 20 | ( _sequence++ & 0xfffff ); }
+    
+    unsigned long                   _random;
+    long                            _sequence;
+};
+
+#pragma mark -
+
+// timer workload: keep pending timers queued, repeatedly fire the earliest and arm a new one after it
+
+// pop selects between pop_min and a remove of min(), which has to compare its way back down
+double benchTimersAVL( long pending, long operations, bool pop ) {
+    AVL<long>                       avl( compareLongs );
+    Timers                          timers( 1 );
+    double                          start;
+    long                            key, i;
+    
+    for ( i = 0; i < pending; ++i ) avl.insert( timers.next( 0 ) );
+    
+    start = now();
+    
+    for ( i = 0; i < operations; ++i ) {
+        if ( pop ) {
+            avl.pop_min( &key );
+        } else {
+            avl.min( &key );
+            avl.remove( key );
+        }
+        
+        avl.insert( timers.next( key >> 20 ) );
+    }
+    
+    return now() - start;
+}
+
+double benchTimersPriorityQueue( long pending, long operations ) {
+    priority_queue<long, vector<long>, greater<long> > queue;
+    Timers                          timers( 1 );
+    double                          start;
+    long                            key, i;
+    
+    for ( i = 0; i < pending; ++i ) queue.push( timers.next( 0 ) );
+    
+    start = now();
+    
+    for ( i = 0; i < operations; ++i ) {
+        key = queue.top();
+        queue.pop();
+        queue.push( timers.next( key >> 20 ) );
+    }
+    
+    return now() - start;
+}
+
+double benchTimersSet( long pending, long operations ) {
+    set<long>                       timerSet;
+    Timers                          timers( 1 );
+    double                          start;
+    long                            key, i;
+    
+    for ( i = 0; i < pending; ++i ) timerSet.insert( timers.next( 0 ) );
+    
+    start = now();
+    
+    for ( i = 0; i < operations; ++i ) {
+        key = *timerSet.begin();
+        timerSet.erase( timerSet.begin() );
+        timerSet.insert( timers.next( key >> 20 ) );
+    }
+    
+    return now() - start;
+}
+
+void benchTimers() {
+    long                            operations = 2000000, pending;
+    
+    cout << "timers: pop the earliest deadline and arm a new one, ns per operation\n";
+    printf( "%10s %10s %12s %16s %10s\n", "pending", "pop_min", "min+remove", "priority_queue", "set" );
+    
+    for ( pending = 1000; pending <= 1000000; pending *= 10 ) {
+        printf( "%10ld %10.1f %12.1f %16.1f %10.1f\n", pending,
+            benchTimersAVL( pending, operations, true ) * 1e9 / operations,
+            benchTimersAVL( pending, operations, false ) * 1e9 / operations,
+            benchTimersPriorityQueue( pending, operations ) * 1e9 / operations,
+            benchTimersSet( pending, operations ) * 1e9 / operations );
+    }
+}
+
+#pragma mark -
+
+// churn workload: keep size random keys in the tree, repeatedly removing one at random and
+// inserting a new one. keys holds the keys present so a remove always finds its key
+
+template<typename B> double benchChurn( long size, long operations, double *rotations ) {
+    AVL<long, void, B>              avl( compareLongs );
+    vector<long>                    keys;
+    Timers                          timers( 1 );
+    double                          start;
+    long                            i, index;
+    unsigned long                   random;
+    
+    for ( i = 0; i < size; ++i ) {
+        keys.push_back( timers.next( i ) );
+        avl.insert( keys.back() );
+    }
+    
+    *rotations = avl.rotations();
+    random = 1;
+    start = now();
+    
+    for ( i = 0; i < operations; ++i ) {
+        random = random * 6364136223846793005UL + 1442695040888963407UL;
+        index = (long) ( ( random >> 33 ) % size );
+        
+        avl.remove( keys[ index ] );
+        avl.insert( keys[ index ] = timers.next( (long) ( ( random >> 20 ) & 0xfffff ) ) );
+    }
+    
+    start = now() - start;
+    *rotations = ( avl.rotations() - *rotations ) / operations;
+    
+    return start;
+}
+
+void benchPolicies() {
+    long                            operations = 2000000, size;
+    double                          rotationsStrict, rotationsWeak, strict, weak;
+    
+    cout << "churn: remove a random key and insert a new one, ns and rotations per remove + insert\n";
+    printf( "%10s %10s %10s %10s %10s\n", "size", "strict", "rotations", "weak", "rotations" );
+    
+    for ( size = 1000; size <= 1000000; size *= 10 ) {
+        strict = benchChurn<AVLBalanceStrict>( size, operations, &rotationsStrict );
+        weak = benchChurn<AVLBalanceWeak>( size, operations, &rotationsWeak );
+        
+        printf( "%10ld %10.1f %10.3f %10.1f %10.3f\n", size,
+            strict * 1e9 / operations, rotationsStrict, weak * 1e9 / operations, rotationsWeak );
+    }
+}
+
+#pragma mark -
+
+// layout workload: churn a tree until its nodes are scattered, then time in-order scans and
+// random finds as it is, after compact() and after compact( kAVLCompactVanEmdeBoas )
+
+bool scanCallback( const long &key, void *, void *context ) {
+    *(long *) context += key;
+    
+    return false;
+}
+
+void benchLayout( AVL<long> &avl, const vector<long> &keys, long scans, double *scan, double *find ) {
+    double                          start;
+    long                            i, sum;
+    
+    start = now();
+    for ( i = 0, sum = 0; i < scans; ++i ) avl.traverse( scanCallback, &sum );
+    *scan = ( now() - start ) * 1e9 / ( scans * avl.size() );
+    
+    start = now();
+    for ( i = 0; i < (long) keys.size(); ++i ) sum += avl.find( keys[ i * 7919 % keys.size() ] );
+    *find = ( now() - start ) * 1e9 / keys.size();
+    
+    if ( sum == 42 ) cout << "";    // keep sum alive
+}
+
+void benchCompact() {
+    long                            i, index, size;
+    double                          find[ 3 ], scan[ 3 ];
+    unsigned long                   random;
+    
+    cout << "layout: ns per node of an in-order scan and per find, after churn and after compaction\n";
+    printf( "%10s %10s %10s %10s %10s %10s %10s\n", "size", "scan", "find", "in-order", "find", "vEB", "find" );
+    
+    for ( size = 10000; size <= 1000000; size *= 10 ) {
+        AVL<long>                   avl( compareLongs );
+        vector<long>                keys;
+        Timers                      timers( 1 );
+        
+        for ( i = 0; i < size; ++i ) {
+            keys.push_back( timers.next( i ) );
+            avl.insert( keys.back() );
+        }
+        
+        for ( i = 0, random = 1; i < 4 * size; ++i ) {
+            random = random * 6364136223846793005UL + 1442695040888963407UL;
+            index = (long) ( ( random >> 33 ) % size );
+            
+            avl.remove( keys[ index ] );
+            avl.insert( keys[ index ] = timers.next( (long) ( ( random >> 20 ) & 0xfffff ) ) );
+        }
+        
+        benchLayout( avl, keys, 10, &scan[ 0 ], &find[ 0 ] );
+        avl.compact();
+        benchLayout( avl, keys, 10, &scan[ 1 ], &find[ 1 ] );
+        avl.compact( kAVLCompactVanEmdeBoas );
+        benchLayout( avl, keys, 10, &scan[ 2 ], &find[ 2 ] );
+        
+        printf( "%10ld %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", size, scan[ 0 ], find[ 0 ], scan[ 1 ], find[ 1 ], scan[ 2 ], find[ 2 ] );
+    }
+}
+
+#pragma mark -
+
+// footprint workload: the same keys in a set, whose nodes have no value slot, and in a map
+
+// AVLNode is protected so a subclass reports its size
+template<typename V> struct NodeSize : AVL<long, V> { enum { size = sizeof( typename AVL<long, V>::AVLNode ) }; };
+
+// bytes malloc has handed out including its own overhead, or 0 where that can't be had
+long heapInUse() {
+#if defined( __APPLE__ )
+    malloc_statistics_t             statistics;
+    
+    malloc_zone_statistics( NULL, &statistics );
+    
+    return (long) statistics.size_in_use;
+#elif defined( __GLIBC__ ) && __GLIBC_PREREQ( 2, 33 )
+    struct mallinfo2                information = mallinfo2();
+    
+    // large blocks such as a compacted slab are mapped separately
+    return (long) ( information.uordblks + information.hblkhd );
+#else
+    return 0;
+#endif
+}
+
+// name is NULL for a run that shouldn't be reported
+template<typename V> void benchFootprint( const char *name, const vector<long> &keys ) {
+    static long                     value;
+    AVL<long, V> *                  avl;
+    double                          find, insert, start;
+    long                            base, compacted, heap, i, sum;
+    
+    base = heapInUse();
+    avl = new AVL<long, V>( compareLongs );
+    
+    start = now();
+    for ( i = 0; i < (long) keys.size(); ++i ) avl->insert( keys[ i ], (V *) &value );
+    insert = ( now() - start ) * 1e9 / keys.size();
+    heap = heapInUse() - base;
+    
+    avl->compact();
+    compacted = heapInUse() - base;
+    
+    start = now();
+    for ( i = 0, sum = 0; i < (long) keys.size(); ++i ) sum += avl->find( keys[ i * 7919 % keys.size() ] );
+    find = ( now() - start ) * 1e9 / keys.size();
+    
+    delete avl;
+    
+    if ( name ) printf( "%10s %10ld %10.1f %10.1f %10.1f %10.1f\n", name, (long) NodeSize<V>::size, (double) heap / keys.size(), (double) compacted / keys.size(), insert, find );
+    
+    if ( sum == 42 ) cout << "";    // keep sum alive
+}
+
+void benchSet() {
+    vector<long>                    keys;
+    Timers                          timers( 1 );
+    long                            i;
+    
+    for ( i = 0; i < 1000000; ++i ) keys.push_back( timers.next( i ) );
+    
+    cout << "footprint: bytes per node as declared, on the heap and once compacted, and ns per insert and find of " << keys.size() << " keys\n";
+    printf( "%10s %10s %10s %10s %10s %10s\n", "tree", "node", "heap", "compacted", "insert", "find" );
+    
+    // a first run faults in the heap so neither tree pays for it
+    benchFootprint<long>( NULL, keys );
+    benchFootprint<void>( "set", keys );
+    benchFootprint<long>( "map", keys );
+}
+
+#pragma mark -
+
+// read-mostly workload: threads look up random keys and one lookup in 100 is an insert or
+// remove instead, against AVLReplicated and against one AVL behind a reader-writer lock
+
+struct Readers {
+    AVL<long> *                     _avl;
+    long                            _keys;
+    pthread_rwlock_t                _lock;
+    long                            _operations;
+    AVLReplicated<long> *           _replicated;
+};
+
+void *benchReader( void *context ) {
+    Readers *                       readers = (Readers *) context;
+    unsigned long                   random = (unsigned long) pthread_self();
+    long                            i, key;
+    
+    for ( i = 0; i < readers->_operations; ++i ) {
+        random = random * 6364136223846793005UL + 1442695040888963407UL;
+        key = (long) ( ( random >> 33 ) % readers->_keys );
+        
+        if ( readers->_replicated ) {
+            if ( ( random >> 20 ) % 100 ) readers->_replicated->find( key );
+            else if ( ( random >> 12 ) & 1 ) readers->_replicated->insert( key );
+            else readers->_replicated->remove( key );
+        } else if ( ( random >> 20 ) % 100 ) {
+            pthread_rwlock_rdlock( &readers->_lock );
+            readers->_avl->find( key );
+            pthread_rwlock_unlock( &readers->_lock );
+        } else {
+            pthread_rwlock_wrlock( &readers->_lock );
+            if ( ( random >> 12 ) & 1 ) readers->_avl->insert( key );
+            else readers->_avl->remove( key );
+            pthread_rwlock_unlock( &readers->_lock );
+        }
+    }
+    
+    return NULL;
+}
+
+double benchReaders( Readers *readers, long threads ) {
+    pthread_t                       thread[ 64 ];
+    double                          start;
+    long                            i;
+    
+    start = now();
+    
+    for ( i = 0; i < threads; ++i ) pthread_create( &thread[ i ], NULL, benchReader, readers );
+    for ( i = 0; i < threads; ++i ) pthread_join( thread[ i ], NULL );
+    
+    return threads * readers->_operations / ( now() - start ) / 1e6;
+}
+
+void benchReplicated() {
+    AVL<long>                       avl( compareLongs );
+    AVLReplicated<long>             replicated( compareLongs );
+    Readers                         readers;
+    long                            i, threads;
+    
+    readers._keys = 1000000;
+    readers._operations = 1000000;
+    readers._avl = &avl;
+    pthread_rwlock_init( &readers._lock, NULL );
+    
+    for ( i = 0; i < readers._keys; i += 2 ) {
+        avl.insert( i );
+        replicated.insert( i );
+    }
+    
+    cout << "read-mostly: 99% finds and 1% writes, millions of operations per second over " << replicated.replicas() << " replicas\n";
+    printf( "%10s %12s %12s\n", "threads", "rwlock", "replicated" );
+    
+    for ( threads = 1; threads <= 2 * sysconf( _SC_NPROCESSORS_ONLN ) && threads <= 64; threads *= 2 ) {
+        readers._replicated = NULL;
+        printf( "%10ld %12.2f", threads, benchReaders( &readers, threads ) );
+        readers._replicated = &replicated;
+        printf( " %12.2f\n", benchReaders( &readers, threads ) );
+    }
+    
+    pthread_rwlock_destroy( &readers._lock );
+}
+
+int main( int argc, const char *argv[] ) {
+    benchTimers();
+    benchPolicies();
+    benchCompact();
+    benchSet();
+    benchReplicated();
+    
+    return 0;
+}
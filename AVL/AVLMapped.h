@@ -0,0 +1,328 @@
+//
+//  AVLMapped.h
+//
+//  Copyright (c) 2014 Balance Software. All rights reserved.
+//
+//  Read-only, memory-mapped view of an AVL tree image.
+//
+//  AVLMapped<K,V>::write() stores an AVL<K,V,B> as a relocatable image: a
+//  versioned, checksummed header followed by one fixed-size record per node.
+//  Records are laid out in key order and link to their children by index, so
+//  the in-order position of a node is its index and the image can be mapped
+//  at any address.  open_mapped() maps an image and serves find, iteration
+//  and bounds queries straight from the mapping without deserializing it.
+//
+//  Keys and values are copied into the image bit for bit, so K and V must be
+//  trivially copyable and hold no pointers or owned resources, since an
+//  address means nothing to the next process to open the image.  Types that
+//  aren't trivially copyable and bare pointer types are rejected at compile
+//  time; pointers inside a struct can't be detected and are up to the caller.
+//  Images are only portable between builds with the same K, V, endianness and
+//  alignment; the header records enough to reject a mismatch.  Links read
+//  from an image are checked before they're followed, so a corrupt node costs
+//  a failed lookup rather than a crash.
+
+
+#ifndef __AVLMapped_h__
+#define __AVLMapped_h__
+
+
+#include "AVL.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+#define kAVLImageMagic              "AVLIMAGE"
+#define kAVLImageVersion            1
+#define kAVLImageEndian             0x01020304
+#define kAVLImageNil                0xFFFFFFFF      // an index no node can have, so write rejects trees of this many nodes or more
+
+struct AVLImageHeader {
+    char                            _magic[ 8 ];
+    uint32_t                        _version;
+    uint32_t                        _endian;
+    uint32_t                        _keySize;
+    uint32_t                        _valueSize;
+    uint32_t                        _nodeSize;
+    uint32_t                        _root;
+    uint64_t                        _count;
+    uint64_t                        _nodesChecksum;
+    uint64_t                        _reserved;
+    uint64_t                        _headerChecksum;    // covers every field above
+};
+
+template<typename K, typename V> struct AVLImageNode {
+    const V *value() const { return _hasValue ? &_value : NULL; }
+    void setValue( const V *value ) { if ( ( _hasValue = value != NULL ) ) memcpy( &_value, value, sizeof( V ) ); }
+
+    K                               _key;
+    uint32_t                        _left;
+    uint32_t                        _right;
+    uint32_t                        _hasValue;
+    V                               _value;
+};
+
+template<typename K> struct AVLImageNode<K, void> {
+    const void *value() const { return NULL; }
+    void setValue( const void * ) {}
+
+    K                               _key;
+    uint32_t                        _left;
+    uint32_t                        _right;
+};
+
+template<typename V> struct AVLImageValueSize { enum { size = sizeof( V ) }; };
+template<> struct AVLImageValueSize<void> { enum { size = 0 }; };
+
+// word-at-a-time FNV-1a variant; this guards against torn or truncated writes, not tampering
+inline uint64_t AVLImageChecksum( const void *bytes, size_t length ) {
+    const unsigned char *           p = (const unsigned char *) bytes;
+    uint64_t                        hash = 0xcbf29ce484222325ULL, word;
+
+    for ( ; length >= sizeof( word ); p += sizeof( word ), length -= sizeof( word ) ) {
+        memcpy( &word, p, sizeof( word ) );
+        hash = ( hash ^ word ) * 0x100000001b3ULL;
+    }
+
+    for ( ; length; ++p, --length ) hash = ( hash ^ *p ) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+template<typename K, typename V = void> class AVLMapped {
+
+    static_assert( std::is_trivially_copyable<K>::value, "AVLMapped keys are copied into the image bit for bit" );
+    static_assert( std::is_void<V>::value || std::is_trivially_copyable<V>::value, "AVLMapped values are copied into the image bit for bit" );
+    static_assert( ! std::is_pointer<K>::value && ! std::is_pointer<V>::value, "AVLMapped images outlive the addresses a pointer key or value would hold" );
+
+protected:
+
+    typedef AVLImageNode<K,V>       AVLNode;
+
+public:
+
+    typedef typename AVL<K,V>::AVLComparator AVLComparator;
+    // AVLMappedCallback should return true to stop traversing
+    typedef bool (*AVLMappedCallback)( const K &key, const V *value, void *context );
+
+    AVLMapped( AVLComparator comparator ) { _comparator = comparator; _header = NULL; _nodes = NULL; _length = 0; }
+    virtual ~AVLMapped() { close(); }
+
+    // write and open_mapped return 0 on success or an errno value, write EOVERFLOW if the tree
+    // has kAVLImageNil nodes or more
+    template<typename B> static int write( const AVL<K,V,B> &avl, const char *path );
+    int open_mapped( const char *path );
+    void close() { if ( _header ) munmap( (void *) _header, _length ); _header = NULL; _nodes = NULL; _length = 0; }
+    int verify() const;
+
+    bool find( const K &key, const V **value = NULL ) const;
+    long size() const { return _header ? (long) _header->_count : 0; }
+    void traverse( AVLMappedCallback callback, void *context = NULL ) const;
+
+    // nodes are stored in key order so an index doubles as an iterator: keys
+    // in [ lower_bound( lo ), upper_bound( hi ) ) are those with lo <= key <= hi
+    long lower_bound( const K &key ) const { return bound( key, false ); }
+    long upper_bound( const K &key ) const { return bound( key, true ); }
+    const K &key( long index ) const { return _nodes[ index ]._key; }
+    const V *value( long index ) const { return _nodes[ index ].value(); }
+
+protected:
+
+    // N is the node type of the tree being written, which depends on its balancing policy
+    template<typename N> static uint32_t write( const N *root, AVLNode *nodes, uint32_t *next );
+    static bool valid( const AVLImageHeader *header, size_t length );
+    long bound( const K &key, bool upper ) const;
+
+    AVLComparator                   _comparator;
+    const AVLImageHeader *          _header;
+    size_t                          _length;
+    const AVLNode *                 _nodes;
+
+};
+
+#pragma mark -
+
+template<typename K, typename V> template<typename B> int AVLMapped<K,V>::write( const AVL<K,V,B> &avl, const char *path ) {
+    AVLImageHeader *                header;
+    size_t                          length, nodesLength;
+    uint32_t                        next;
+    char *                          temporary;
+    int                             error, fd;
+    void *                          map;
+
+    // nodes are numbered with 32 bits, so a tree too large for that fails here rather than
+    // leaving an image that open_mapped would reject
+
+    if ( (unsigned long) avl._count >= kAVLImageNil ) return EOVERFLOW;
+
+    // write to a temporary file and rename it into place so that processes
+    // with the previous image mapped never see a truncated file
+
+    if ( ! ( temporary = (char *) malloc( strlen( path ) + 5 ) ) ) return ENOMEM;
+
+    strcpy( temporary, path );
+    strcat( temporary, ".tmp" );
+
+    nodesLength = (size_t) avl._count * sizeof( AVLNode );
+    length = sizeof( AVLImageHeader ) + nodesLength;
+    map = MAP_FAILED;
+    error = 0;
+
+    if ( ( fd = ::open( temporary, O_RDWR | O_CREAT | O_TRUNC, 0644 ) ) < 0 ) error = errno;
+    else if ( ftruncate( fd, (off_t) length ) ) error = errno;
+    else if ( ( map = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) == MAP_FAILED ) error = errno;
+    else {
+        header = (AVLImageHeader *) map;
+        next = 0;
+
+        memcpy( header->_magic, kAVLImageMagic, sizeof( header->_magic ) );
+        header->_version = kAVLImageVersion;
+        header->_endian = kAVLImageEndian;
+        header->_keySize = sizeof( K );
+        header->_valueSize = AVLImageValueSize<V>::size;
+        header->_nodeSize = sizeof( AVLNode );
+        header->_root = write( avl._root, (AVLNode *) ( header + 1 ), &next );
+        header->_count = next;
+        header->_nodesChecksum = AVLImageChecksum( header + 1, nodesLength );
+        header->_headerChecksum = AVLImageChecksum( header, offsetof( AVLImageHeader, _headerChecksum ) );
+
+        if ( msync( map, length, MS_SYNC ) ) error = errno;
+    }
+
+    if ( map != MAP_FAILED ) munmap( map, length );
+    if ( fd >= 0 && ::close( fd ) && ! error ) error = errno;
+    if ( ! error && rename( temporary, path ) ) error = errno;
+    if ( error && fd >= 0 ) unlink( temporary );
+
+    free( temporary );
+
+    return error;
+}
+
+template<typename K, typename V> template<typename N> uint32_t AVLMapped<K,V>::write( const N *root, AVLNode *nodes, uint32_t *next ) {
+    AVLNode *                       node;
+    uint32_t                        index, left;
+
+    if ( ! root ) return kAVLImageNil;
+
+    // an in-order walk numbers the nodes so that the index of a node is its rank
+    left = write( root->_left, nodes, next );
+    index = (*next)++;
+
+    node = &nodes[ index ];
+    node->_key = root->_key;
+    node->_left = left;
+    node->setValue( root->value() );
+    node->_right = write( root->_right, nodes, next );
+
+    return index;
+}
+
+template<typename K, typename V> int AVLMapped<K,V>::open_mapped( const char *path ) {
+    struct stat                     info;
+    int                             error, fd;
+    void *                          map;
+
+    close();
+
+    if ( ( fd = ::open( path, O_RDONLY ) ) < 0 ) return errno;
+
+    if ( fstat( fd, &info ) ) error = errno;
+    else if ( (size_t) info.st_size < sizeof( AVLImageHeader ) ) error = EINVAL;
+    else if ( ( map = mmap( NULL, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ) == MAP_FAILED ) error = errno;
+    else if ( ! valid( (const AVLImageHeader *) map, (size_t) info.st_size ) ) {
+        munmap( map, (size_t) info.st_size );
+        error = EINVAL;
+    } else {
+        _header = (const AVLImageHeader *) map;
+        _nodes = (const AVLNode *) ( _header + 1 );
+        _length = (size_t) info.st_size;
+        error = 0;
+    }
+
+    // the mapping keeps the file referenced so the descriptor isn't needed anymore
+    ::close( fd );
+
+    return error;
+}
+
+template<typename K, typename V> bool AVLMapped<K,V>::valid( const AVLImageHeader *header, size_t length ) {
+    return
+        ! memcmp( header->_magic, kAVLImageMagic, sizeof( header->_magic ) ) &&
+        header->_version == kAVLImageVersion &&
+        header->_endian == kAVLImageEndian &&
+        header->_keySize == sizeof( K ) &&
+        header->_valueSize == AVLImageValueSize<V>::size &&
+        header->_nodeSize == sizeof( AVLNode ) &&
+        header->_headerChecksum == AVLImageChecksum( header, offsetof( AVLImageHeader, _headerChecksum ) ) &&
+        header->_count < kAVLImageNil &&
+        length == sizeof( AVLImageHeader ) + header->_count * sizeof( AVLNode ) &&
+        ( header->_count ? header->_root < header->_count : header->_root == kAVLImageNil );
+}
+
+// open_mapped only validates the header so that opening is O(1); verify
+// touches every page of the image to check the node checksum
+template<typename K, typename V> int AVLMapped<K,V>::verify() const {
+    if ( ! _header ) return EINVAL;
+
+    return AVLImageChecksum( _nodes, _length - sizeof( AVLImageHeader ) ) == _header->_nodesChecksum ? 0 : EINVAL;
+}
+
+template<typename K, typename V> bool AVLMapped<K,V>::find( const K &key, const V **value ) const {
+    long                            c, count, depth;
+    uint32_t                        index;
+
+    // open_mapped doesn't check the nodes, so a walk ends at an index out of range or once it
+    // has taken more steps than there are nodes, which only a cycle can make it do
+    count = size();
+
+    for ( depth = 0, index = _header ? _header->_root : kAVLImageNil; index < (uint32_t) count && depth < count; ++depth ) {
+        c = _comparator( key, _nodes[ index ]._key );
+
+        if ( c < 0 ) index = _nodes[ index ]._left;
+        else if ( c > 0 ) index = _nodes[ index ]._right;
+        else {
+            if ( value ) *value = _nodes[ index ].value();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template<typename K, typename V> long AVLMapped<K,V>::bound( const K &key, bool upper ) const {
+    long                            c, count, depth, result;
+    uint32_t                        index;
+
+    // result is the leftmost index whose key is >= key (> key when upper). the walk is bounded as in find
+    for ( depth = 0, result = count = size(), index = _header ? _header->_root : kAVLImageNil; index < (uint32_t) count && depth < count; ++depth ) {
+        c = _comparator( _nodes[ index ]._key, key );
+
+        if ( c > 0 || ( c == 0 && ! upper ) ) {
+            result = index;
+            index = _nodes[ index ]._left;
+        } else {
+            index = _nodes[ index ]._right;
+        }
+    }
+
+    return result;
+}
+
+template<typename K, typename V> void AVLMapped<K,V>::traverse( AVLMappedCallback callback, void *context ) const {
+    long                            count, index;
+
+    for ( index = 0, count = size(); index < count; ++index ) {
+        if ( callback( _nodes[ index ]._key, _nodes[ index ].value(), context ) ) break;
+    }
+}
+
+
+#endif // __AVLMapped_h__
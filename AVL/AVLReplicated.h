@@ -0,0 +1,480 @@
+//
+//  AVLReplicated.h
+//
+//  Copyright (c) 2014 Balance Software. All rights reserved.
+//
+//  NUMA-aware replicated AVL tree for read-mostly workloads.
+//
+//  AVLReplicated keeps one AVL per NUMA node so that reads never leave the
+//  socket they run on.  Writes are appended to a shared, bounded operation
+//  log and each replica replays the log lazily, under its own lock, before it
+//  serves a read.  A read first brings its replica up to the log tail it sees
+//  when it starts, so it observes every write that completed before it.  Only one reader
+//  replays at a time; the others that find the replica behind wait for it on
+//  the read lock instead of queueing for the write lock one after another.
+//
+//  Replicas are made for the NUMA nodes that have CPUs and a thread reads from
+//  the replica of the node sched_getcpu() puts it on.  On Linux each replica,
+//  and every node of its tree, lives in memory mapped for it and bound to its
+//  node with mbind; a replica reuses the nodes its own removes free and never
+//  touches memory that another replica's tree has used.  While it replays, the
+//  calling thread's memory policy prefers the replica's node as well, for
+//  anything a key or value copy allocates, and is restored afterwards.  All of
+//  this is best effort: without the syscalls, or on other platforms, replicas
+//  take their memory wherever it falls and every thread reads from the first
+//  replica unless more are asked for.
+//
+//  Writers only touch the log.  When the log is full the writer replays it
+//  into every replica that lags a full log behind, so a replica no thread
+//  reads from can't stall writers for long.  Replica locks prefer writers where
+//  the platform allows it, so callbacks passed to traverse run with the replica
+//  locked for reading and must not call back into the tree.
+
+
+#ifndef __AVLReplicated_h__
+#define __AVLReplicated_h__
+
+
+#include "AVL.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+    #include <sched.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+
+#ifndef kAVLReplicatedLogLength
+    // writes a replica may fall behind before a writer has to replay them for it
+    #define kAVLReplicatedLogLength 4096
+#endif
+
+#ifndef kAVLReplicatedChunkSize
+    // bytes of node memory a replica maps at a time
+    #define kAVLReplicatedChunkSize ( 1L << 20 )
+#endif
+
+#define kAVLMemPolicyPreferred      1               // MPOL_PREFERRED from numaif.h
+#define kAVLNumaMaxNodes            1024            // the node masks passed to the kernel have room for this many nodes
+#define kAVLNumaMaskWords           ( kAVLNumaMaxNodes / ( 8 * sizeof( unsigned long ) ) )
+
+// the memory policy of a thread, as get_mempolicy reports it
+struct AVLNumaPolicy {
+    int                             _mode;
+    unsigned long                   _mask[ kAVLNumaMaskWords ];
+    bool                            _saved;
+};
+
+// AVLNumaTopology lists the NUMA nodes that have CPUs and the node each CPU is on. it's read
+// from sysfs once, since a replica for a node without CPUs would be one no thread reads from
+// but every writer has to keep replaying into
+struct AVLNumaTopology {
+    AVLNumaTopology();
+
+    // the ordinal among nodes with CPUs of the node the calling thread runs on
+    long current() const;
+    static void *map( size_t length, long node );
+    static void mask( long node, unsigned long *mask ) { memset( mask, 0, kAVLNumaMaskWords * sizeof( *mask ) ); mask[ node / ( 8 * sizeof( *mask ) ) ] |= 1UL << ( node % ( 8 * sizeof( *mask ) ) ); }
+    // prefer node for the pages the calling thread faults in, saving its policy for restore
+    static void prefer( long node, AVLNumaPolicy *previous );
+    static bool read( const char *path, std::vector<bool> *set );
+    static void restore( const AVLNumaPolicy *previous );
+    static const AVLNumaTopology &shared() { static AVLNumaTopology topology; return topology; }
+    static void unmap( void *memory, size_t length );
+
+    std::vector<long>               _cpus;          // CPU number to the ordinal of its node
+    std::vector<long>               _nodes;         // ordinal to node number
+};
+
+// AVLNumaMemory hands out the nodes of one tree from chunks mapped on a NUMA node. nodes
+// the tree frees are kept for its next inserts rather than going back to malloc, where
+// another thread's tree could pick them up
+struct AVLNumaMemory : AVLAllocator {
+    AVLNumaMemory( long node ) { _chunks = _free = NULL; _end = _next = NULL; _node = node; }
+    ~AVLNumaMemory();
+
+    void *allocate( size_t size );
+    void deallocate( void *memory ) { *(void **) memory = _free; _free = memory; }
+
+    void *                          _chunks;        // each starts with a link to the one mapped before it
+    char *                          _end;           // of the unused space in the newest chunk
+    void *                          _free;          // freed nodes, linked through their first word
+    char *                          _next;          // unused space in the newest chunk
+    long                            _node;
+};
+
+#pragma mark -
+
+inline AVLNumaTopology::AVLNumaTopology() {
+#ifdef __linux__
+    std::vector<bool>               cpus, nodes;
+    long                            cpu, node;
+    char                            path[ 64 ];
+
+    if ( ! read( "/sys/devices/system/node/has_cpu", &nodes ) ) read( "/sys/devices/system/node/online", &nodes );
+
+    for ( node = 0; node < (long) nodes.size() && node < kAVLNumaMaxNodes; ++node ) {
+        if ( ! nodes[ node ] ) continue;
+
+        snprintf( path, sizeof( path ), "/sys/devices/system/node/node%ld/cpulist", node );
+        cpus.clear();
+        read( path, &cpus );
+
+        for ( cpu = 0; cpu < (long) cpus.size(); ++cpu ) {
+            if ( ! cpus[ cpu ] ) continue;
+            if ( cpu >= (long) _cpus.size() ) _cpus.resize( cpu + 1, 0 );
+            _cpus[ cpu ] = (long) _nodes.size();
+        }
+
+        _nodes.push_back( node );
+    }
+#endif
+
+    if ( _nodes.empty() ) _nodes.push_back( 0 );
+}
+
+// sched_getcpu is answered from the vDSO or rseq without entering the kernel
+inline long AVLNumaTopology::current() const {
+#ifdef __linux__
+    int                             cpu = sched_getcpu();
+
+    if ( cpu >= 0 && cpu < (long) _cpus.size() ) return _cpus[ cpu ];
+#endif
+
+    return 0;
+}
+
+// map length bytes preferring node. mbind only takes effect for pages not yet touched, hence the mmap
+inline void *AVLNumaTopology::map( size_t length, long node ) {
+    void *                          memory;
+
+#ifdef __linux__
+    unsigned long                   bits[ kAVLNumaMaskWords ];
+
+    if ( ( memory = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) ) == MAP_FAILED ) throw std::bad_alloc();
+
+    mask( node, bits );
+    syscall( SYS_mbind, memory, length, kAVLMemPolicyPreferred, bits, kAVLNumaMaxNodes, 0 );
+#else
+    (void) node;
+
+    if ( posix_memalign( &memory, 64, length ) ) throw std::bad_alloc();
+#endif
+
+    return memory;
+}
+
+inline void AVLNumaTopology::prefer( long node, AVLNumaPolicy *previous ) {
+#ifdef __linux__
+    unsigned long                   bits[ kAVLNumaMaskWords ];
+
+    // only change the policy if it can be put back, so a policy such as numactl --interleave survives
+    if ( ( previous->_saved = ! syscall( SYS_get_mempolicy, &previous->_mode, previous->_mask, kAVLNumaMaxNodes, NULL, 0 ) ) ) {
+        mask( node, bits );
+        syscall( SYS_set_mempolicy, kAVLMemPolicyPreferred, bits, kAVLNumaMaxNodes );
+    }
+#else
+    (void) node;
+
+    previous->_saved = false;
+#endif
+}
+
+// read a sysfs list such as "0-3,8,10-11" into set. returns false if the file can't be read
+inline bool AVLNumaTopology::read( const char *path, std::vector<bool> *set ) {
+    FILE *                          file;
+    long                            first, last;
+    int                             c;
+
+    if ( ! ( file = fopen( path, "r" ) ) ) return false;
+
+    while ( fscanf( file, "%ld", &first ) == 1 && first >= 0 ) {
+        last = first;
+
+        if ( ( c = fgetc( file ) ) == '-' ) {
+            if ( fscanf( file, "%ld", &last ) != 1 ) break;
+            c = fgetc( file );
+        }
+
+        if ( last >= (long) set->size() ) set->resize( last + 1, false );
+        for ( ; first <= last; ++first ) (*set)[ first ] = true;
+
+        if ( c != ',' ) break;
+    }
+
+    fclose( file );
+
+    return true;
+}
+
+inline void AVLNumaTopology::restore( const AVLNumaPolicy *previous ) {
+#ifdef __linux__
+    if ( previous->_saved ) syscall( SYS_set_mempolicy, previous->_mode, previous->_mask, kAVLNumaMaxNodes );
+#else
+    (void) previous;
+#endif
+}
+
+inline void AVLNumaTopology::unmap( void *memory, size_t length ) {
+#ifdef __linux__
+    munmap( memory, length );
+#else
+    (void) length;
+
+    free( memory );
+#endif
+}
+
+inline AVLNumaMemory::~AVLNumaMemory() {
+    void *                          chunk;
+
+    while ( ( chunk = _chunks ) ) {
+        _chunks = *(void **) chunk;
+        AVLNumaTopology::unmap( chunk, kAVLReplicatedChunkSize );
+    }
+}
+
+// every request is for a node of the same tree, so a freed node fits any later request
+inline void *AVLNumaMemory::allocate( size_t size ) {
+    void *                          memory;
+
+    if ( ( memory = _free ) ) {
+        _free = *(void **) memory;
+        return memory;
+    }
+
+    // a chunk's link takes its first cache line so the nodes after it stay aligned
+    if ( (size_t) ( _end - _next ) < size ) {
+        memory = AVLNumaTopology::map( kAVLReplicatedChunkSize, _node );
+        *(void **) memory = _chunks;
+        _chunks = memory;
+        _next = (char *) memory + 64;
+        _end = (char *) memory + kAVLReplicatedChunkSize;
+    }
+
+    memory = _next;
+    _next += size;
+
+    return memory;
+}
+
+template<typename K, typename V = void, typename B = AVLBalanceStrict> class AVLReplicated {
+
+public:
+
+    typedef typename AVL<K,V,B>::AVLComparator AVLComparator;
+    typedef typename AVL<K,V,B>::AVLTraverseCallback AVLTraverseCallback;
+
+    // replicas defaults to one per NUMA node
+    AVLReplicated( AVLComparator comparator, long replicas = 0, long logLength = kAVLReplicatedLogLength );
+    virtual ~AVLReplicated();
+
+    bool find( const K &key, V **value = NULL );
+    void insert( const K &key, V *value = NULL ) { append( key, value, false ); }
+    void remove( const K &key ) { append( key, NULL, true ); }
+    // replica is the index of the replica serving the calling thread
+    long replica() const;
+    long replicas() const { return _replicaCount; }
+    long size();
+    void traverse( AVLTraverseCallback callback, void *context = NULL, AVLTraverseMethod method = kAVLTraverseInfix );
+
+    // the number of NUMA nodes with CPUs, 1 if it can't be determined
+    static long nodes() { return (long) AVLNumaTopology::shared()._nodes.size(); }
+
+protected:
+
+    struct AVLLogEntry {
+        K                           _key;
+        bool                        _remove;
+        V *                         _value;
+    };
+
+    struct AVLReplica {
+        AVLReplica( AVLComparator comparator, long node );
+        ~AVLReplica() { pthread_rwlock_destroy( &_lock ); }
+
+        AVLNumaMemory               _allocator;     // declared ahead of _avl so it outlives the tree's nodes
+        std::atomic<unsigned long>  _applied;       // log entries replayed, only advanced with _lock held for writing
+        AVL<K,V,B>                  _avl;
+        pthread_rwlock_t            _lock;
+        long                        _node;
+        std::atomic<bool>           _replaying;     // set while a reader has taken on the replay
+    };
+
+    void append( const K &key, V *value, bool remove );
+    void catchUp( AVLReplica *replica, unsigned long tail );
+    AVLReplica *local() { AVLReplica *r = _replicas[ replica() ]; unsigned long tail = _tail.load( std::memory_order_acquire ); if ( r->_applied.load( std::memory_order_acquire ) < tail ) catchUp( r, tail ); return r; }
+    void replay( AVLReplica *replica, unsigned long tail );
+    void update( AVLReplica *replica ) { pthread_rwlock_wrlock( &replica->_lock ); replay( replica, _tail.load( std::memory_order_acquire ) ); pthread_rwlock_unlock( &replica->_lock ); }
+
+    AVLLogEntry *                   _log;
+    long                            _logLength;
+    pthread_mutex_t                 _logLock;       // serializes writers
+    long                            _replicaCount;
+    AVLReplica **                   _replicas;
+    std::atomic<unsigned long>      _tail;          // log entries written
+
+};
+
+#pragma mark -
+
+template<typename K, typename V, typename B> AVLReplicated<K,V,B>::AVLReplica::AVLReplica( AVLComparator comparator, long node ) : _allocator( node ), _avl( comparator, &_allocator ) {
+    pthread_rwlockattr_t            attributes;
+
+    _applied = 0;
+    _node = node;
+    _replaying = false;
+
+    // with readers preferred a steady stream of them could keep a replay out forever
+
+    pthread_rwlockattr_init( &attributes );
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np( &attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+#endif
+    pthread_rwlock_init( &_lock, &attributes );
+    pthread_rwlockattr_destroy( &attributes );
+}
+
+template<typename K, typename V, typename B> AVLReplicated<K,V,B>::AVLReplicated( AVLComparator comparator, long replicas, long logLength ) {
+    const AVLNumaTopology &         topology = AVLNumaTopology::shared();
+    long                            index, node;
+
+    _replicaCount = replicas > 0 ? replicas : nodes();
+    _logLength = logLength > 0 ? logLength : 1;
+    _log = new AVLLogEntry[ _logLength ];
+    _replicas = new AVLReplica *[ _replicaCount ];
+    _tail = 0;
+
+    pthread_mutex_init( &_logLock, NULL );
+
+    // replica i lives on the i-th node with CPUs, wrapping around if there are more replicas than nodes
+
+    for ( index = 0; index < _replicaCount; ++index ) {
+        node = topology._nodes[ index % topology._nodes.size() ];
+        _replicas[ index ] = new ( AVLNumaTopology::map( sizeof( AVLReplica ), node ) ) AVLReplica( comparator, node );
+    }
+}
+
+template<typename K, typename V, typename B> AVLReplicated<K,V,B>::~AVLReplicated() {
+    long                            index;
+
+    for ( index = 0; index < _replicaCount; ++index ) {
+        _replicas[ index ]->~AVLReplica();
+        AVLNumaTopology::unmap( _replicas[ index ], sizeof( AVLReplica ) );
+    }
+
+    pthread_mutex_destroy( &_logLock );
+
+    delete [] _replicas;
+    delete [] _log;
+}
+
+template<typename K, typename V, typename B> void AVLReplicated<K,V,B>::append( const K &key, V *value, bool remove ) {
+    AVLLogEntry *                   entry;
+    long                            index;
+    unsigned long                   tail;
+
+    pthread_mutex_lock( &_logLock );
+
+    tail = _tail.load( std::memory_order_relaxed );
+
+    // the entry about to be reused must have been replayed everywhere. a replica that is
+    // replaying holds its lock so update waits for it and then finds little or nothing to do
+
+    if ( tail >= (unsigned long) _logLength ) {
+        for ( index = 0; index < _replicaCount; ++index ) {
+            if ( _replicas[ index ]->_applied.load( std::memory_order_acquire ) <= tail - _logLength ) update( _replicas[ index ] );
+        }
+    }
+
+    entry = &_log[ tail % _logLength ];
+    entry->_key = key;
+    entry->_remove = remove;
+    entry->_value = value;
+
+    _tail.store( tail + 1, std::memory_order_release );
+
+    pthread_mutex_unlock( &_logLock );
+}
+
+// bring replica up to at least tail for a reader. the reader that claims the replay takes
+// the write lock; the rest wait on the read lock, which the pending replay holds back
+template<typename K, typename V, typename B> void AVLReplicated<K,V,B>::catchUp( AVLReplica *replica, unsigned long tail ) {
+    bool                            replaying;
+
+    while ( replica->_applied.load( std::memory_order_acquire ) < tail ) {
+        replaying = false;
+
+        if ( replica->_replaying.compare_exchange_strong( replaying, true, std::memory_order_acquire ) ) {
+            update( replica );
+            replica->_replaying.store( false, std::memory_order_release );
+        } else {
+            pthread_rwlock_rdlock( &replica->_lock );
+            pthread_rwlock_unlock( &replica->_lock );
+        }
+    }
+}
+
+template<typename K, typename V, typename B> bool AVLReplicated<K,V,B>::find( const K &key, V **value ) {
+    AVLReplica *                    replica = local();
+    bool                            found;
+
+    pthread_rwlock_rdlock( &replica->_lock );
+    found = replica->_avl.find( key, value );
+    pthread_rwlock_unlock( &replica->_lock );
+
+    return found;
+}
+
+// bring replica up to tail. the caller holds its lock for writing
+template<typename K, typename V, typename B> void AVLReplicated<K,V,B>::replay( AVLReplica *replica, unsigned long tail ) {
+    AVLLogEntry *                   entry;
+    unsigned long                   applied;
+    AVLNumaPolicy                   policy;
+
+    if ( ( applied = replica->_applied.load( std::memory_order_relaxed ) ) >= tail ) return;
+
+    if ( _replicaCount > 1 ) AVLNumaTopology::prefer( replica->_node, &policy );
+
+    for ( ; applied < tail; ++applied ) {
+        entry = &_log[ applied % _logLength ];
+
+        if ( entry->_remove ) replica->_avl.remove( entry->_key );
+        else replica->_avl.insert( entry->_key, entry->_value );
+    }
+
+    if ( _replicaCount > 1 ) AVLNumaTopology::restore( &policy );
+
+    replica->_applied.store( tail, std::memory_order_release );
+}
+
+template<typename K, typename V, typename B> long AVLReplicated<K,V,B>::replica() const {
+    return _replicaCount > 1 ? AVLNumaTopology::shared().current() % _replicaCount : 0;
+}
+
+template<typename K, typename V, typename B> long AVLReplicated<K,V,B>::size() {
+    AVLReplica *                    replica = local();
+    long                            count;
+
+    pthread_rwlock_rdlock( &replica->_lock );
+    count = replica->_avl.size();
+    pthread_rwlock_unlock( &replica->_lock );
+
+    return count;
+}
+
+template<typename K, typename V, typename B> void AVLReplicated<K,V,B>::traverse( AVLTraverseCallback callback, void *context, AVLTraverseMethod method ) {
+    AVLReplica *                    replica = local();
+
+    pthread_rwlock_rdlock( &replica->_lock );
+    replica->_avl.traverse( callback, context, method );
+    pthread_rwlock_unlock( &replica->_lock );
+}
+
+
+#endif // __AVLReplicated_h__
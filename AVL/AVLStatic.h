@@ -0,0 +1,241 @@
+//
+//  AVLStatic.h
+//
+//  Copyright (c) 2014 Balance Software. All rights reserved.
+//
+//  Fixed-capacity AVL tree that can be built and searched at compile time.
+//
+//  AVLStatic<K,V,N> keeps up to N entries in an array of nodes linked by
+//  index, so it never allocates and every member function is constexpr.  A
+//  table built by AVLStaticMake() in a constexpr variable is constant
+//  initialized: it lives in read-only data, costs nothing at startup and
+//  can't be seen half built by another static initializer.  find() and
+//  index() work in constant expressions as well as at run time.
+//
+//  K and V must be literal types and the comparator a constexpr function for
+//  any of this to happen at compile time.  Unlike AVL, values are stored by
+//  value.  Requires C++14, which also wants every local initialized in a
+//  constexpr function.
+
+
+#ifndef __AVLStatic_h__
+#define __AVLStatic_h__
+
+
+#include <assert.h>
+#include <stddef.h>
+
+template<typename K, typename V> struct AVLStaticEntry {
+    K                               _key;
+    V                               _value;
+};
+
+template<typename K, typename V, long N> class AVLStatic {
+
+public:
+
+    // AVLComparator return value is to zero as lhs is to rhs
+    typedef long (*AVLComparator)( const K &lhs, const K &rhs );
+    // AVLStaticCallback should return true to stop traversing
+    typedef bool (*AVLStaticCallback)( const K &key, const V &value, void *context );
+
+    constexpr AVLStatic( AVLComparator comparator ) : _comparator( comparator ), _count( 0 ), _nodes(), _root( -1 ) {}
+
+    constexpr bool find( const K &key, const V **value = NULL ) const { long i = index( key ); if ( i >= 0 && value ) *value = &_nodes[ i ]._value; return i >= 0; }
+    // index returns the slot holding key or -1, for key() and value()
+    constexpr long index( const K &key ) const;
+    // insert returns false if key is already present or the tree is full
+    constexpr bool insert( const K &key, const V &value );
+    constexpr const K &key( long index ) const { return _nodes[ index ]._key; }
+    constexpr long size() const { return _count; }
+    constexpr bool traverse( AVLStaticCallback callback, void *context = NULL ) const { return traverse( _root, callback, context ); }
+    constexpr const V &value( long index ) const { return _nodes[ index ]._value; }
+
+protected:
+
+    struct AVLNode {
+        constexpr AVLNode() : _key(), _height( 0 ), _left( -1 ), _right( -1 ), _value() {}
+        constexpr AVLNode( const K &key, const V &value ) : _key( key ), _height( 1 ), _left( -1 ), _right( -1 ), _value( value ) {}
+
+        K                           _key;
+        long                        _height;
+        long                        _left;          // child indices, -1 for none
+        long                        _right;
+        V                           _value;
+    };
+
+    constexpr long height( long node ) const { return node < 0 ? 0 : _nodes[ node ]._height; }
+    constexpr long insert( long root, const K &key, const V &value, bool *inserted );
+    constexpr long rebalance( long x );
+    constexpr long rotate( long x, bool left );
+    constexpr bool traverse( long root, AVLStaticCallback callback, void *context ) const;
+    constexpr void update( long x ) { long l = height( _nodes[ x ]._left ), r = height( _nodes[ x ]._right ); _nodes[ x ]._height = 1 + ( l > r ? l : r ); }
+
+#if ENABLE_AVL_UNIT_TESTS
+    constexpr bool verifyAVL( long root, const K *lo, const K *hi, long *count ) const;
+#endif
+
+    AVLComparator                   _comparator;
+    long                            _count;
+    AVLNode                         _nodes[ N ];
+    long                            _root;
+
+};
+
+// build a table from entries at compile time, e.g.
+//
+//     constexpr AVLStaticEntry<char, int> entries[] = { { 'a', 1 }, { 'b', 2 } };
+//     constexpr auto table = AVLStaticMake( compare, entries );
+//
+// entries with duplicate keys after the first are dropped, so size() < N reveals them
+template<typename K, typename V, long N> constexpr AVLStatic<K,V,N> AVLStaticMake( typename AVLStatic<K,V,N>::AVLComparator comparator, const AVLStaticEntry<K,V> ( &entries )[ N ] ) {
+    AVLStatic<K,V,N>                avl( comparator );
+
+    for ( long i = 0; i < N; ++i ) avl.insert( entries[ i ]._key, entries[ i ]._value );
+
+    return avl;
+}
+
+// a comparator for C string keys usable in constant expressions
+constexpr long AVLStaticCompareStrings( const char * const &lhs, const char * const &rhs ) {
+    const char *                    l = lhs, *r = rhs;
+
+    for ( ; *l && *l == *r; ++l, ++r ) {}
+
+    return (long) (unsigned char) *l - (long) (unsigned char) *r;
+}
+
+#pragma mark -
+
+template<typename K, typename V, long N> constexpr long AVLStatic<K,V,N>::index( const K &key ) const {
+    long                            c = 0, node = _root;
+
+    for ( ; node >= 0; ) {
+        c = _comparator( key, _nodes[ node ]._key );
+
+        if ( c < 0 ) node = _nodes[ node ]._left;
+        else if ( c > 0 ) node = _nodes[ node ]._right;
+        else return node;
+    }
+
+    return -1;
+}
+
+template<typename K, typename V, long N> constexpr bool AVLStatic<K,V,N>::insert( const K &key, const V &value ) {
+    bool                            inserted = false;
+
+    if ( _count < N ) _root = insert( _root, key, value, &inserted );
+
+#if ENABLE_AVL_UNIT_TESTS
+    long                            count = 0;
+
+    assert( verifyAVL( _root, NULL, NULL, &count ) && count == _count );
+#endif
+
+    return inserted;
+}
+
+// insert into the subtree at root and return the index of its root afterwards. the
+// recursion is no deeper than the tree. nodes are relinked rather than trading entries
+// as AVL does since an index costs nothing to update
+template<typename K, typename V, long N> constexpr long AVLStatic<K,V,N>::insert( long root, const K &key, const V &value, bool *inserted ) {
+    long                            c = 0;
+
+    if ( root < 0 ) {
+        _nodes[ _count ] = AVLNode( key, value );
+        *inserted = true;
+
+        return _count++;
+    }
+
+    c = _comparator( key, _nodes[ root ]._key );
+
+    if ( c < 0 ) _nodes[ root ]._left = insert( _nodes[ root ]._left, key, value, inserted );
+    else if ( c > 0 ) _nodes[ root ]._right = insert( _nodes[ root ]._right, key, value, inserted );
+    else return root;               // ignore duplicates
+
+    return rebalance( root );
+}
+
+// recompute the height of x and rotate if its subtrees differ in height by more than one,
+// returning the index of the subtree's root
+template<typename K, typename V, long N> constexpr long AVLStatic<K,V,N>::rebalance( long x ) {
+    long                            balance = 0, y = 0;
+
+    balance = height( _nodes[ x ]._left ) - height( _nodes[ x ]._right );
+
+    if ( balance > 1 ) {
+        y = _nodes[ x ]._left;
+        if ( height( _nodes[ y ]._left ) < height( _nodes[ y ]._right ) ) _nodes[ x ]._left = rotate( y, true );
+
+        return rotate( x, false );
+    } else if ( balance < -1 ) {
+        y = _nodes[ x ]._right;
+        if ( height( _nodes[ y ]._right ) < height( _nodes[ y ]._left ) ) _nodes[ x ]._right = rotate( y, false );
+
+        return rotate( x, true );
+    }
+
+    update( x );
+
+    return x;
+}
+
+// rotate the subtree at x left or right and return its new root
+template<typename K, typename V, long N> constexpr long AVLStatic<K,V,N>::rotate( long x, bool left ) {
+    long                            y = 0;
+
+    if ( left ) {
+        y = _nodes[ x ]._right;                 /*     x                    y        */
+        _nodes[ x ]._right = _nodes[ y ]._left; /*    / \                 /   \      */
+        _nodes[ y ]._left = x;                  /*   0   y      =>       x     2     */
+    } else {                                    /*      / \             / \          */
+        y = _nodes[ x ]._left;                  /*     1   2           0   1         */
+        _nodes[ x ]._left = _nodes[ y ]._right;
+        _nodes[ y ]._right = x;
+    }
+
+    update( x );
+    update( y );
+
+    return y;
+}
+
+template<typename K, typename V, long N> constexpr bool AVLStatic<K,V,N>::traverse( long root, AVLStaticCallback callback, void *context ) const {
+    if ( root < 0 ) return false;
+
+    return
+        traverse( _nodes[ root ]._left, callback, context ) ||
+        callback( _nodes[ root ]._key, _nodes[ root ]._value, context ) ||
+        traverse( _nodes[ root ]._right, callback, context );
+}
+
+#if ENABLE_AVL_UNIT_TESTS
+
+// verify heights, balance and that every key lies between lo and hi, which are NULL when unbounded
+template<typename K, typename V, long N> constexpr bool AVLStatic<K,V,N>::verifyAVL( long root, const K *lo, const K *hi, long *count ) const {
+    long                            balance = 0, countLeft = 0, countRight = 0, heightLeft = 0, heightRight = 0;
+
+    *count = 0;
+
+    if ( root < 0 ) return true;
+
+    const AVLNode &                 node = _nodes[ root ];
+
+    heightLeft = height( node._left );
+    heightRight = height( node._right );
+    balance = heightLeft - heightRight;
+
+    if ( ( lo && _comparator( *lo, node._key ) >= 0 ) || ( hi && _comparator( node._key, *hi ) >= 0 ) ) return false;
+    if ( node._height != 1 + ( heightLeft > heightRight ? heightLeft : heightRight ) || balance < -1 || balance > 1 ) return false;
+    if ( ! verifyAVL( node._left, lo, &node._key, &countLeft ) || ! verifyAVL( node._right, &node._key, hi, &countRight ) ) return false;
+
+    *count = 1 + countLeft + countRight;
+
+    return true;
+}
+
+#endif
+
+
+#endif // __AVLStatic_h__
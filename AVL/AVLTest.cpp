@@ -6,14 +6,20 @@
 //  Copyright (c) 2014 Balance Software. All rights reserved.
 //
 
+#include <algorithm>
 #include <assert.h>
 #include <iostream>
+#include <map>
+#include <string.h>
 
 using namespace std;
 
 #define ENABLE_AVL_UNIT_TESTS       1
 
 #import "AVL.h"
+#import "AVLMapped.h"
+#import "AVLReplicated.h"
+#import "AVLStatic.h"
 
 bool                                gError;
 
@@ -21,6 +27,10 @@ long compareChars( const char &lhs, const char &rhs ) {
     return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
 }
 
+long compareLongs( const long &lhs, const long &rhs ) {
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
 bool traverseBreadth( const char &key, void *value, void *context ) {
     long                            height = *(long *) value;
     char **                         result = (char **) context;
@@ -66,6 +76,9 @@ void expect( AVL<char> & avl, const char * infix, const char *breadth ) {
     }
     free( s );
     
+    // a NULL breadth skips the shape check when only the contents are of interest
+    if ( ! breadth ) return;
+    
     asprintf( &s, "" );
     avl.traverse( traverseBreadth, &s, kAVLTraverseBreadthFirst );
     if ( strcmp( s, breadth ) ) {
@@ -456,7 +469,605 @@ void testRemove5() {
     expect( avl, "h,i,k,m,n,p,q,r,t,v,z", "4:p,3:m,3:t,2:i,1:n,2:r,2:v,1:h,1:k,1:q,1:z" );
 }
 
+bool removeVowels( const char &key, void *value, void *context ) {
+    return strchr( "aeiou", key ) != NULL;
+}
+
+void testRemoveRange() {
+    AVL<char>                       avl( compareChars );
+    
+    for ( const char *key = "abcdefghijklmnop"; *key; ++key ) avl.insert( *key );
+    
+    if ( avl.remove_range( 'd', 'h' ) != 4 || avl.remove_range( 'h', 'h' ) || avl.remove_range( 'q', 'z' ) ) {
+        cerr << "remove_range returned the wrong count\n";
+        gError = 1;
+    }
+    expect( avl, "a,b,c,h,i,j,k,l,m,n,o,p", NULL );
+    
+    avl.remove_range( 'A', 'c' );
+    expect( avl, "c,h,i,j,k,l,m,n,o,p", NULL );
+    
+    if ( avl.remove_if( 'a', 'n', removeVowels ) != 1 ) {
+        cerr << "remove_if returned the wrong count\n";
+        gError = 1;
+    }
+    expect( avl, "c,h,j,k,l,m,n,o,p", NULL );
+    
+    avl.remove_range( 'p', 'q' );
+    expect( avl, "c,h,j,k,l,m,n,o", "4:k,2:h,3:n,1:c,1:j,2:m,1:o,1:l" );
+    
+    avl.remove_range( 'a', 'z' );
+    expect( avl, "", "" );
+    
+    if ( avl.size() ) {
+        cerr << "remove_range left a non-zero size\n";
+        gError = 1;
+    }
+}
+
+void testExtract() {
+    AVL<char, long>                 avl( compareChars ), other( compareChars );
+    AVL<char, long>::AVLHandle      handle;
+    long                            values[ 5 ] = { 'B', 'A', 'D', 'C', 'E' };
+    long *                          value;
+    
+    avl.insert( 'b', &values[ 0 ] );
+    avl.insert( 'a', &values[ 1 ] );
+    avl.insert( 'd', &values[ 2 ] );
+    avl.insert( 'c', &values[ 3 ] );
+    avl.insert( 'e', &values[ 4 ] );
+    
+    // b has two children so its successor c takes its place, along with c's value
+    avl.remove( 'b' );
+    if ( ! avl.find( 'c', &value ) || *value != 'C' ) {
+        cerr << "remove lost the successor's value\n";
+        gError = 1;
+    }
+    
+    if ( avl.extract( 'x', handle ) || ! handle.empty() || ! avl.extract( 'c', handle ) || handle.key() != 'c' || *handle.value() != 'C' || avl.find( 'c' ) || avl.size() != 3 ) {
+        cerr << "extract failed\n";
+        gError = 1;
+    }
+    
+    // a duplicate key leaves the node with the handle
+    handle.setKey( 'a' );
+    if ( avl.insert( handle ) || handle.empty() ) {
+        cerr << "insert of a duplicate handle failed\n";
+        gError = 1;
+    }
+    
+    handle.setKey( 'z' );
+    if ( ! other.insert( handle ) || ! handle.empty() || ! other.find( 'z', &value ) || *value != 'C' || other.size() != 1 ) {
+        cerr << "insert of a handle failed\n";
+        gError = 1;
+    }
+}
+
+void testClear() {
+    AVL<long>                       avl( compareLongs );
+    long                            i, steps;
+    
+    for ( i = 0; i < 1000; ++i ) avl.insert( i );
+    
+    if ( avl.clear_step( 10 ) || avl.size() || avl.find( 0 ) ) {
+        cerr << "clear_step didn't detach the tree\n";
+        gError = 1;
+    }
+    
+    // the tree is usable while detached nodes are still waiting to be freed
+    for ( i = 0; i < 500; ++i ) avl.insert( i );
+    
+    for ( steps = 1; ! avl.clear_step( 10 ); ++steps ) {}
+    
+    if ( steps != 149 || avl.size() ) {
+        cerr << "clear_step took " << steps << " steps instead of 149\n";
+        gError = 1;
+    }
+    
+    for ( i = 0; i < 1000; ++i ) avl.insert( i );
+    
+    avl.clear_async();
+    
+    if ( avl.size() || avl.find( 0 ) ) {
+        cerr << "clear_async didn't detach the tree\n";
+        gError = 1;
+    }
+    
+    // repeated calls all feed the one reclaimer thread
+    for ( steps = 0; steps < 100; ++steps ) {
+        for ( i = 0; i < 100; ++i ) avl.insert( i );
+        avl.clear_async();
+    }
+    
+    // leave some detached nodes for the destructor
+    avl.insert( 0 );
+    avl.clear_step( 0 );
+}
+
+bool traverseNodes( const long &key, void *value, void *context ) {
+    char ***                        next = (char ***) context;
+    
+    // with unit tests enabled value points into the node so it stands for the node's address
+    *(*next)++ = (char *) value;
+    
+    return false;
+}
+
+// true if the nodes are in consecutive, ascending elements of an array
+bool contiguous( char **nodes, long count ) {
+    for ( long i = 2; i < count; ++i ) if ( nodes[ i ] - nodes[ i - 1 ] != nodes[ 1 ] - nodes[ 0 ] ) return false;
+    
+    return count < 2 || nodes[ 1 ] > nodes[ 0 ];
+}
+
+void testCompact() {
+    AVL<long>                       avl( compareLongs ), other( compareLongs );
+    AVL<long>::AVLHandle            handle;
+    char *                          nodes[ 2000 ], **next, *root;
+    long                            i, steps;
+    
+    // churn so the nodes are scattered over the heap
+    for ( i = 0; i < 2000; ++i ) avl.insert( i * 7919 % 2000 );
+    for ( i = 0; i < 2000; i += 2 ) avl.remove( i );
+    
+    avl.compact();
+    next = nodes;
+    avl.traverse( traverseNodes, &next );
+    if ( next - nodes != 1000 || ! contiguous( nodes, 1000 ) ) {
+        cerr << "compact didn't lay the nodes out in key order\n";
+        gError = 1;
+    }
+    
+    // in van Emde Boas order the root comes first
+    avl.compact( kAVLCompactVanEmdeBoas );
+    next = nodes;
+    avl.traverse( traverseNodes, &next, kAVLTraversePrefix );
+    root = nodes[ 0 ];
+    sort( nodes, nodes + 1000 );
+    if ( next - nodes != 1000 || root != nodes[ 0 ] || ! contiguous( nodes, 1000 ) ) {
+        cerr << "compact didn't lay the nodes out in van Emde Boas order\n";
+        gError = 1;
+    }
+    
+    // new nodes come from the heap until compact_step gathers them up with the rest
+    for ( i = 0; i < 2000; i += 2 ) avl.insert( i );
+    
+    for ( steps = 1; ! avl.compact_step( 100 ); ++steps ) {}
+    
+    next = nodes;
+    avl.traverse( traverseNodes, &next );
+    if ( steps != 20 || next - nodes != 2000 || ! contiguous( nodes, 2000 ) ) {
+        cerr << "compact_step took " << steps << " steps or didn't lay the nodes out in key order\n";
+        gError = 1;
+    }
+    
+    // compacted nodes can be removed or moved to another tree, and a pass can be cut short
+    avl.remove( 1000 );
+    avl.pop_min();
+    avl.remove_range( 100, 200 );
+    avl.compact_step( 10 );
+    
+    if ( ! avl.extract( 1001, handle ) || ! other.insert( handle ) || ! other.find( 1001 ) || avl.size() != 1897 ) {
+        cerr << "compacted nodes weren't released properly\n";
+        gError = 1;
+    }
+    
+    avl.clear_async();
+}
+
+void testMinMax() {
+    AVL<char>                       avl( compareChars );
+    char                            key;
+    
+    if ( avl.min( &key ) || avl.max( &key ) || avl.pop_min() || avl.pop_max() ) {
+        cerr << "min/max of an empty tree succeeded\n";
+        gError = 1;
+    }
+    
+    for ( const char *k = "hdlbfjnacegikmo"; *k; ++k ) avl.insert( *k );
+    
+    if ( ! avl.min( &key ) || key != 'a' || ! avl.max( &key ) || key != 'o' ) {
+        cerr << "min/max failed\n";
+        gError = 1;
+    }
+    
+    if ( ! avl.pop_min( &key ) || key != 'a' || ! avl.pop_min( &key ) || key != 'b' || ! avl.pop_max( &key ) || key != 'o' ) {
+        cerr << "pop_min/pop_max failed\n";
+        gError = 1;
+    }
+    expect( avl, "c,d,e,f,g,h,i,j,k,l,m,n", "4:h,3:d,3:l,1:c,2:f,2:j,2:n,1:e,1:g,1:i,1:k,1:m" );
+    
+    avl.remove( 'c' );
+    avl.insert( 'p' );
+    if ( ! avl.min( &key ) || key != 'd' || ! avl.max( &key ) || key != 'p' ) {
+        cerr << "min/max after remove/insert failed\n";
+        gError = 1;
+    }
+    
+    while ( avl.pop_max() ) {}
+    expect( avl, "", "" );
+}
+
+bool removeOdd( const long &key, long *value, void *context ) {
+    return key & 1;
+}
+
+// run a random mix of operations against both AVL and std::map and compare every result.
+// the tree is large enough that only the sampled full verification keeps this quick
+template<typename B> void testDifferential( long operations, unsigned long seed ) {
+    AVL<long, long, B>              avl( compareLongs );
+    typename AVL<long, long, B>::AVLHandle handle;
+    map<long, long *>               reference;
+    map<long, long *>::iterator     i;
+    long                            slots[ 256 ], choice, count, hi, key, keys, lo, operation;
+    long *                          value;
+    bool                            found;
+    
+    keys = operations / 4 + 16;
+    
+    for ( operation = 0; operation < operations && ! gError; ++operation ) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        key = (long) ( ( seed >> 20 ) % keys );
+        value = &slots[ ( seed >> 12 ) & 0xff ];
+        
+        choice = (long) ( ( seed >> 40 ) % 100 );
+        
+        if ( choice < 40 ) {
+            avl.insert( key, value );
+            reference.insert( make_pair( key, value ) );
+        } else if ( choice < 60 ) {
+            avl.remove( key );
+            reference.erase( key );
+        } else if ( choice < 70 ) {
+            found = avl.find( key, &value );
+            i = reference.find( key );
+            if ( found != ( i != reference.end() ) || ( found && value != i->second ) ) gError = 1;
+        } else if ( choice < 80 ) {
+            found = ( seed >> 40 ) & 1 ? avl.pop_min( &key, &value ) : avl.pop_max( &key, &value );
+            if ( found != ! reference.empty() ) gError = 1;
+            if ( found ) {
+                i = ( seed >> 40 ) & 1 ? reference.begin() : --reference.end();
+                if ( key != i->first || value != i->second ) gError = 1;
+                reference.erase( i );
+            }
+        } else if ( choice < 90 ) {
+            found = avl.extract( key, handle );
+            i = reference.find( key );
+            if ( found != ( i != reference.end() ) || ( found && handle.value() != i->second ) ) gError = 1;
+            if ( found ) {
+                // rekey the entry and move it back in, a duplicate leaves it with the handle
+                value = i->second;
+                reference.erase( i );
+                handle.setKey( key = (long) ( ( seed >> 8 ) % keys ) );
+                if ( avl.insert( handle ) != reference.insert( make_pair( key, value ) ).second ) gError = 1;
+            }
+        } else if ( choice < 95 ) {
+            lo = key;
+            hi = key + (long) ( ( seed >> 8 ) & 0x3f );
+            count = ( seed >> 40 ) & 1 ? avl.remove_range( lo, hi ) : avl.remove_if( lo, hi, removeOdd );
+            for ( i = reference.lower_bound( lo ); i != reference.end() && i->first < hi; ) {
+                if ( ( seed >> 40 ) & 1 || i->first & 1 ) { reference.erase( i++ ); --count; } else ++i;
+            }
+            if ( count ) gError = 1;
+        } else {
+            if ( avl.min( &key ) != ! reference.empty() || ( ! reference.empty() && key != reference.begin()->first ) ) gError = 1;
+            if ( avl.max( &key ) != ! reference.empty() || ( ! reference.empty() && key != reference.rbegin()->first ) ) gError = 1;
+            
+            // relayout now and then so the operations above also run on compacted nodes
+            if ( ! ( ( seed >> 8 ) & 0x3ff ) ) avl.compact( ( seed >> 16 ) & 1 ? kAVLCompactVanEmdeBoas : kAVLCompactInOrder );
+            else avl.compact_step( ( seed >> 8 ) & 0x3f );
+        }
+        
+        if ( avl.size() != (long) reference.size() ) gError = 1;
+    }
+    
+    for ( i = reference.begin(); i != reference.end(); ++i ) {
+        if ( ! avl.find( i->first, &value ) || value != i->second ) gError = 1;
+    }
+    
+    if ( gError ) cerr << "AVL and std::map differ after " << operation << " operations\n";
+}
+
+void testWeak() {
+    AVL<long, void, AVLBalanceWeak> avl( compareLongs );
+    long                            key, rotations;
+    
+    // inserts under the weak rules rotate as the strict ones do
+    for ( key = 0; key < 4096; ++key ) avl.insert( key * 7919 % 4096 );
+    
+    // and a remove or pop rotates at most twice
+    for ( key = 0; key < 4096 && ! gError; ++key ) {
+        rotations = avl.rotations();
+        
+        if ( key & 1 ) avl.remove( key * 4007 % 4096 );
+        else avl.pop_min();
+        
+        if ( avl.rotations() - rotations > 2 ) {
+            cerr << "weak remove of " << key << " rotated " << avl.rotations() - rotations << " times\n";
+            gError = 1;
+        }
+    }
+}
+
+// AVLNode is protected so a subclass reports its size
+template<typename V> struct NodeSize : AVL<long, V> { enum { size = sizeof( typename AVL<long, V>::AVLNode ) }; };
+
+static_assert( NodeSize<void>::size + sizeof( long * ) == NodeSize<long>::size, "a set node shouldn't have a value slot" );
+
+void testSet() {
+    AVL<long>                       avl( compareLongs );
+    void *                          value;
+    long                            key;
+    
+    for ( key = 0; key < 64; ++key ) avl.insert( key, &key );
+    
+    // values passed to a set are dropped
+    value = &key;
+    
+    if ( ! avl.find( 17, &value ) || value || ! avl.pop_max( &key, &value ) || key != 63 || value ) {
+        cerr << "set returned a value\n";
+        gError = 1;
+    }
+}
+
+// run a random mix of operations against a multiset and a std::map of counts. rotations and
+// removes trade entries between nodes so this checks that every count moves with its key
+template<typename B> void testMultiple( long operations, unsigned long seed ) {
+    AVL<long, void, B, AVLMultiple> avl( compareLongs );
+    typename AVL<long, void, B, AVLMultiple>::AVLHandle handle;
+    map<long, long>                 reference;
+    map<long, long>::iterator       i;
+    long                            choice, count, key, keys, operation;
+    
+    keys = operations / 16 + 16;
+    
+    for ( operation = 0; operation < operations && ! gError; ++operation ) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        key = (long) ( ( seed >> 20 ) % keys );
+        
+        choice = (long) ( ( seed >> 40 ) % 100 );
+        
+        if ( choice < 45 ) {
+            avl.insert( key );
+            ++reference[ key ];
+        } else if ( choice < 70 ) {
+            avl.remove_one( key );
+            if ( ( i = reference.find( key ) ) != reference.end() && ! --i->second ) reference.erase( i );
+        } else if ( choice < 75 ) {
+            avl.remove_all( key );
+            reference.erase( key );
+        } else if ( choice < 85 ) {
+            i = reference.find( key );
+            if ( avl.count( key ) != ( i == reference.end() ? 0 : i->second ) ) gError = 1;
+        } else if ( choice < 90 ) {
+            // a pop takes one occurrence of the first or last key, as a priority queue would
+            if ( ( seed >> 8 ) & 1 ) {
+                if ( avl.pop_max( &key ) != ! reference.empty() || ( ! reference.empty() && key != reference.rbegin()->first ) ) gError = 1;
+                if ( ! reference.empty() && ! --reference.rbegin()->second ) reference.erase( --reference.end() );
+            } else {
+                if ( avl.pop_min( &key ) != ! reference.empty() || ( ! reference.empty() && key != reference.begin()->first ) ) gError = 1;
+                if ( ! reference.empty() && ! --reference.begin()->second ) reference.erase( reference.begin() );
+            }
+        } else if ( choice < 95 ) {
+            // a rekeyed node brings its occurrences along and merges them into a present key
+            if ( avl.extract( key, handle ) ) {
+                count = reference[ key ];
+                reference.erase( key );
+                handle.setKey( key = (long) ( ( seed >> 8 ) % keys ) );
+                if ( ! avl.insert( handle ) || ! handle.empty() ) gError = 1;
+                reference[ key ] += count;
+            } else if ( reference.count( key ) ) gError = 1;
+        } else {
+            avl.compact_step( ( seed >> 8 ) & 0x3f );
+        }
+        
+        if ( avl.size() != (long) reference.size() ) gError = 1;
+    }
+    
+    for ( i = reference.begin(); i != reference.end(); ++i ) {
+        if ( avl.count( i->first ) != i->second ) gError = 1;
+    }
+    
+    if ( gError ) cerr << "multiset and std::map of counts differ after " << operation << " operations\n";
+}
+
+bool traverseMapped( const char &key, const long *value, void *context ) {
+    char **                         result = (char **) context;
+    
+    *(*result)++ = key;
+    *(*result)++ = value ? (char) *value : '-';
+    
+    return false;
+}
+
+void testMapped() {
+    AVL<char, long>                 avl( compareChars );
+    AVLMapped<char, long>           mapped( compareChars ), corrupt( compareChars );
+    AVLImageHeader                  header;
+    AVLImageNode<char, long>        node;
+    off_t                           offset;
+    int                             fd;
+    const char *                    path = "/tmp/AVLTest.image";
+    char                            buffer[ 32 ], *s;
+    const char *                    keys = "hdlbfjnaceg";
+    long                            values[ 11 ];
+    const long *                    value;
+    
+    if ( AVLMapped<char, long>::write( avl, path ) || mapped.open_mapped( path ) || mapped.size() || mapped.find( 'a' ) ) {
+        cerr << "empty mapped image failed\n";
+        gError = 1;
+    }
+    
+    for ( long i = 0; keys[ i ]; ++i ) {
+        values[ i ] = 'A' + i;
+        avl.insert( keys[ i ], i % 3 ? &values[ i ] : NULL );
+    }
+    
+    if ( AVLMapped<char, long>::write( avl, path ) || mapped.open_mapped( path ) || mapped.verify() ) {
+        cerr << "mapped image could not be written or opened\n";
+        gError = 1;
+        return;
+    }
+    
+    // point the root of another image out of range on the left and back at itself on the right.
+    // the header still checks out so it opens, but lookups must fail rather than crash or spin
+    if ( ! AVLMapped<char, long>::write( avl, path ) && ( fd = open( path, O_RDWR ) ) >= 0 ) {
+        if ( pread( fd, &header, sizeof( header ), 0 ) == sizeof( header ) ) {
+            offset = sizeof( header ) + header._root * sizeof( node );
+            if ( pread( fd, &node, sizeof( node ), offset ) == sizeof( node ) ) {
+                node._left = 1000;
+                node._right = header._root;
+                if ( pwrite( fd, &node, sizeof( node ), offset ) != sizeof( node ) ) gError = 1;
+            }
+        }
+        close( fd );
+        
+        if ( corrupt.open_mapped( path ) || ! corrupt.verify() || corrupt.find( 'a' ) || corrupt.find( 'z' ) || corrupt.lower_bound( 'z' ) != 11 ) {
+            cerr << "corrupt mapped image wasn't contained\n";
+            gError = 1;
+        }
+    }
+    
+    avl.clear();
+    unlink( path );
+    
+    s = buffer;
+    mapped.traverse( traverseMapped, &s );
+    *s = 0;
+    if ( mapped.size() != 11 || strcmp( buffer, "aHb-cIdBe-fEgKh-jFlCn-" ) ) {
+        cerr << "mapped traversal result " << buffer << " does not match expected\n";
+        gError = 1;
+    }
+    
+    if ( ! mapped.find( 'f', &value ) || ! value || *value != 'E' || ! mapped.find( 'h', &value ) || value || mapped.find( 'i' ) ) {
+        cerr << "mapped find failed\n";
+        gError = 1;
+    }
+    
+    if ( mapped.lower_bound( 'a' ) != 0 || mapped.lower_bound( 'i' ) != 8 || mapped.key( mapped.lower_bound( 'i' ) ) != 'j' ||
+         mapped.upper_bound( 'j' ) != 9 || mapped.upper_bound( 'n' ) != 11 || mapped.lower_bound( 'z' ) != 11 ) {
+        cerr << "mapped bounds failed\n";
+        gError = 1;
+    }
+}
+
+// counts the nodes it has out so a test can check that every node comes from it and goes back
+struct CountingAllocator : AVLAllocator {
+    CountingAllocator() { _live = 0; }
+    
+    void *allocate( size_t size ) { ++_live; return malloc( size ); }
+    void deallocate( void *memory ) { --_live; free( memory ); }
+    
+    long                            _live;
+};
+
+void testAllocator() {
+    CountingAllocator               allocator;
+    AVL<long, long> *               avl = new AVL<long, long>( compareLongs, &allocator );
+    AVL<long, long>::AVLHandle      handle;
+    long                            i;
+    
+    for ( i = 0; i < 1000; ++i ) avl->insert( i );
+    
+    // extract moves a node to the heap and inserting a handle moves it back
+    avl->extract( 5, handle );
+    handle.setKey( 5000 );
+    avl->insert( handle );
+    avl->remove_range( 100, 200 );
+    avl->remove( 300 );
+    avl->compact();
+    avl->insert( 2000 );
+    
+    // the allocator isn't called from other threads so clear_async leaves the nodes for clear_step
+    avl->clear_async();
+    
+    if ( avl->clear_step( 0 ) ) {
+        cerr << "clear_async handed a tree with an allocator to the reclaimer\n";
+        gError = 1;
+    }
+    
+    // and the destructor frees what remains of those along with a partly compacted tree
+    for ( i = 0; i < 3000; ++i ) avl->insert( i );
+    avl->compact_step( 100 );
+    
+    delete avl;
+    
+    if ( allocator._live ) {
+        cerr << "tree with an allocator left " << allocator._live << " of its nodes\n";
+        gError = 1;
+    }
+}
+
+void testReplicated() {
+    // more replicas than nodes and a short log so writers have to replay for idle replicas
+    AVLReplicated<long, long>       avl( compareLongs, 3, 4 );
+    long                            i, values[ 100 ], *value;
+    
+    for ( i = 0; i < 100; ++i ) avl.insert( i, &values[ i ] );
+    for ( i = 0; i < 100; i += 2 ) avl.remove( i );
+    
+    if ( avl.replicas() != 3 || avl.replica() < 0 || avl.replica() >= 3 || avl.size() != 50 ) {
+        cerr << "replicated tree has " << avl.size() << " entries instead of 50\n";
+        gError = 1;
+    }
+    
+    for ( i = 0; i < 100; ++i ) {
+        if ( avl.find( i, &value ) != ( i & 1 ) || ( i & 1 && value != &values[ i ] ) ) {
+            cerr << "replicated find of " << i << " failed\n";
+            gError = 1;
+        }
+    }
+    
+    // reads catch up with writes made since the last read
+    avl.insert( 0 );
+    avl.remove( 1 );
+    
+    if ( ! avl.find( 0 ) || avl.find( 1 ) || avl.size() != 50 ) {
+        cerr << "replicated find didn't see the latest writes\n";
+        gError = 1;
+    }
+}
+
+// built and checked by the compiler, the duplicate "if" is dropped
+constexpr AVLStaticEntry<const char *, long> gKeywordEntries[] = {
+    { "if", 1 }, { "else", 2 }, { "while", 3 }, { "for", 4 }, { "do", 5 }, { "break", 6 }, { "continue", 7 }, { "return", 8 }, { "if", 9 }
+};
+constexpr AVLStatic<const char *, long, 9> gKeywords = AVLStaticMake( AVLStaticCompareStrings, gKeywordEntries );
+
+static_assert( gKeywords.size() == 8, "constexpr insert didn't drop the duplicate" );
+static_assert( gKeywords.find( "while" ) && gKeywords.find( "break" ) && ! gKeywords.find( "goto" ), "constexpr find failed" );
+static_assert( gKeywords.value( gKeywords.index( "if" ) ) == 1 && gKeywords.value( gKeywords.index( "return" ) ) == 8, "constexpr value failed" );
+
+bool traverseStatic( const char * const &key, const long &value, void *context ) {
+    char **                         result = (char **) context;
+    
+    *result += sprintf( *result, "%s%ld,", key, value );
+    
+    return false;
+}
+
+void testStatic() {
+    char                            buffer[ 128 ], *s = buffer;
+    const long *                    value;
+    
+    // the table is constant initialized so it's complete before any code runs
+    gKeywords.traverse( traverseStatic, &s );
+    if ( strcmp( buffer, "break6,continue7,do5,else2,for4,if1,return8,while3," ) ) {
+        cerr << "static traversal result " << buffer << " does not match expected\n";
+        gError = 1;
+    }
+    
+    if ( ! gKeywords.find( "for", &value ) || *value != 4 || gKeywords.find( "fo" ) || gKeywords.find( "form" ) ) {
+        cerr << "static find failed\n";
+        gError = 1;
+    }
+}
+
 int main( int argc, const char *argv[] ) {
+    // the differential test takes an optional operation count and seed
+    long                            operations = argc > 1 ? atol( argv[ 1 ] ) : 1000000;
+    unsigned long                   seed = argc > 2 ? strtoul( argv[ 2 ], NULL, 0 ) : 1;
+    
     cout << "starting AVL tests, errors will be reported on stderr\n";
     
     testInsert0();
@@ -470,6 +1081,22 @@ int main( int argc, const char *argv[] ) {
     testRemove3();
     testRemove4();
     testRemove5();
+    testRemoveRange();
+    testExtract();
+    testClear();
+    testCompact();
+    testMinMax();
+    testDifferential<AVLBalanceStrict>( operations, seed );
+    testDifferential<AVLBalanceWeak>( operations, seed );
+    testWeak();
+    testSet();
+    testMultiple<AVLBalanceStrict>( operations / 4, seed );
+    testMultiple<AVLBalanceWeak>( operations / 4, seed );
+    
+    testMapped();
+    testAllocator();
+    testReplicated();
+    testStatic();
 
     cout << "AVL tests completed\n";
     